@@ -0,0 +1,448 @@
+/*
+ * Copyright 2000-2016 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmark driver: builds a synthetic tree (on tmpfs by default), runs the notifier binary on it
+// and measures registration time, watch tree memory, event throughput under storms and end-to-end latency.
+// Talks to the binary over the ordinary stdin/stdout protocol; a reader thread consumes the output.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define USAGE_MSG \
+    "usage: bench [options] <fsnotifier binary>\n" \
+    "  -d <depth>      depth of the synthetic tree (default 4)\n" \
+    "  -f <fan-out>    subdirectories per directory (default 8)\n" \
+    "  -n <files>      files per directory (default 4)\n" \
+    "  -t <dir>        where to create the tree, preferably on tmpfs (default $XDG_RUNTIME_DIR, or /tmp);\n" \
+    "                  /dev/shm will not do, mounts below /dev are not watched\n" \
+    "  -s <ops>        operations per storm (default 20000)\n" \
+    "  -l <samples>    latency samples (default 1000)\n"
+
+#define LINE_LEN (PATH_MAX + 64)
+#define TIMEOUT_SEC 60
+
+typedef struct {
+  int depth;
+  int fanout;
+  int files;
+  const char* tmp_dir;
+  int storm_ops;
+  int samples;
+} options;
+
+typedef struct {
+  char** dirs;
+  int dir_count;
+  int dir_capacity;
+} tree;
+
+// what the reader thread has seen so far; guarded by `lock`
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint64_t events;
+  uint64_t dirty;  // DIRTY/RECDIRTY, i.e. lost events
+  int roots_acks;
+  int counter_replies;
+  bool closed;
+  char wanted[PATH_MAX];
+  bool wanted_seen;
+  char counters[32][LINE_LEN];
+  int counter_count;
+} seen = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static FILE* to_child = NULL;
+static FILE* from_child = NULL;
+
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(const char* what) {
+  fprintf(stderr, "bench: %s: %s\n", what, strerror(errno));
+  exit(1);
+}
+
+static void touch(const char* path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) die(path);
+  close(fd);
+}
+
+static void append(const char* path) {
+  int fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (fd < 0) die(path);
+  if (write(fd, "x", 1) != 1) die(path);
+  close(fd);
+}
+
+
+static void add_dir(tree* t, const char* path) {
+  if (t->dir_count == t->dir_capacity) {
+    t->dir_capacity = (t->dir_capacity > 0 ? t->dir_capacity * 2 : 1024);
+    t->dirs = realloc(t->dirs, sizeof(char*) * t->dir_capacity);
+    if (t->dirs == NULL) die("realloc");
+  }
+  t->dirs[t->dir_count++] = strdup(path);
+}
+
+static void build_tree(tree* t, const options* o, const char* path, int level) {
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) die(path);
+  add_dir(t, path);
+
+  char child[PATH_MAX];
+  for (int i=0; i<o->files; i++) {
+    snprintf(child, PATH_MAX, "%s/file%d.txt", path, i);
+    touch(child);
+  }
+  if (level < o->depth) {
+    for (int i=0; i<o->fanout; i++) {
+      snprintf(child, PATH_MAX, "%s/dir%d", path, i);
+      build_tree(t, o, child, level + 1);
+    }
+  }
+}
+
+static int remove_entry(const char* path, const struct stat* st, int flag, struct FTW* ftw) {
+  (void)st; (void)flag; (void)ftw;
+  remove(path);
+  return 0;
+}
+
+
+// the output protocol: an event name line followed by a path line (two for MOVE), or a block up to "#"
+static void* read_output(void* arg) {
+  (void)arg;
+  char line[LINE_LEN], path[LINE_LEN];
+
+  while (fgets(line, LINE_LEN, from_child) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+
+    if (strcmp(line, "UNWATCHEABLE") == 0 || strcmp(line, "UNCOVERED") == 0 || strcmp(line, "COUNTERS") == 0 ||
+        strcmp(line, "FEATURES") == 0 || strcmp(line, "TRACE") == 0) {
+      bool counters = strcmp(line, "COUNTERS") == 0;
+      pthread_mutex_lock(&seen.lock);
+      if (counters) seen.counter_count = 0;
+      pthread_mutex_unlock(&seen.lock);
+      while (fgets(path, LINE_LEN, from_child) != NULL && strcmp(path, "#\n") != 0) {
+        if (counters && seen.counter_count < 32) {
+          path[strcspn(path, "\n")] = '\0';
+          pthread_mutex_lock(&seen.lock);
+          strcpy(seen.counters[seen.counter_count++], path);
+          pthread_mutex_unlock(&seen.lock);
+        }
+      }
+      pthread_mutex_lock(&seen.lock);
+      if (strcmp(line, "UNWATCHEABLE") == 0) seen.roots_acks++;
+      if (counters) seen.counter_replies++;
+      pthread_cond_broadcast(&seen.cond);
+      pthread_mutex_unlock(&seen.lock);
+      continue;
+    }
+    if (strcmp(line, "RESET") == 0 || strcmp(line, "GIVEUP") == 0) {
+      continue;
+    }
+
+    int paths = (strcmp(line, "MOVE") == 0 ? 2 : 1);
+    for (int i=0; i<paths; i++) {
+      if (fgets(path, LINE_LEN, from_child) == NULL) break;
+      path[strcspn(path, "\n")] = '\0';
+    }
+    if (strcmp(line, "MESSAGE") == 0) {
+      fprintf(stderr, "bench: notifier message: %s\n", path);
+      continue;
+    }
+
+    pthread_mutex_lock(&seen.lock);
+    seen.events++;
+    if (strcmp(line, "DIRTY") == 0 || strcmp(line, "RECDIRTY") == 0) seen.dirty++;
+    if (seen.wanted[0] != '\0' && strcmp(path, seen.wanted) == 0) {
+      seen.wanted_seen = true;
+      pthread_cond_broadcast(&seen.cond);
+    }
+    pthread_mutex_unlock(&seen.lock);
+  }
+
+  pthread_mutex_lock(&seen.lock);
+  seen.closed = true;
+  pthread_cond_broadcast(&seen.cond);
+  pthread_mutex_unlock(&seen.lock);
+  return NULL;
+}
+
+// waits (with `seen.lock` held) until the value at `counter` reaches `target`
+static bool await_count(const int* counter, int target) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += TIMEOUT_SEC;
+  while (*counter < target && !seen.closed) {
+    if (pthread_cond_timedwait(&seen.cond, &seen.lock, &deadline) == ETIMEDOUT) return false;
+  }
+  return *counter >= target;
+}
+
+// the marker file is created and its event awaited: everything queued before it has been delivered
+static bool await_path(const char* path) {
+  pthread_mutex_lock(&seen.lock);
+  snprintf(seen.wanted, PATH_MAX, "%s", path);
+  seen.wanted_seen = false;
+  pthread_mutex_unlock(&seen.lock);
+
+  touch(path);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += TIMEOUT_SEC;
+  pthread_mutex_lock(&seen.lock);
+  bool timed_out = false;
+  while (!seen.wanted_seen && !seen.closed && !timed_out) {
+    timed_out = pthread_cond_timedwait(&seen.cond, &seen.lock, &deadline) == ETIMEDOUT;
+  }
+  bool result = seen.wanted_seen;
+  seen.wanted[0] = '\0';
+  pthread_mutex_unlock(&seen.lock);
+  return result;
+}
+
+static void send_command(const char* command) {
+  fputs(command, to_child);
+  fflush(to_child);
+}
+
+static long long counter(const char* name) {
+  int len = strlen(name);
+  long long value = -1;
+  pthread_mutex_lock(&seen.lock);
+  for (int i=0; i<seen.counter_count; i++) {
+    if (strncmp(seen.counters[i], name, len) == 0 && seen.counters[i][len] == ' ') {
+      value = atoll(seen.counters[i] + len + 1);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&seen.lock);
+  return value;
+}
+
+static bool query_counters() {
+  pthread_mutex_lock(&seen.lock);
+  int target = seen.counter_replies + 1;
+  pthread_mutex_unlock(&seen.lock);
+  send_command("STATS\n");
+  pthread_mutex_lock(&seen.lock);
+  bool result = await_count(&seen.counter_replies, target);
+  pthread_mutex_unlock(&seen.lock);
+  return result;
+}
+
+static long rss_kb(pid_t pid) {
+  char name[64], line[256];
+  snprintf(name, sizeof(name), "/proc/%d/status", (int)pid);
+  FILE* f = fopen(name, "r");
+  long value = -1;
+  while (f != NULL && fgets(line, sizeof(line), f) != NULL) {
+    if (strncmp(line, "VmRSS:", 6) == 0) value = atol(line + 6);
+  }
+  if (f != NULL) fclose(f);
+  return value;
+}
+
+static pid_t spawn(const char* binary) {
+  int in[2], out[2];
+  if (pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0) die("pipe");
+
+  pid_t pid = fork();
+  if (pid < 0) die("fork");
+  if (pid == 0) {
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    execl(binary, binary, (char*)NULL);
+    _exit(127);
+  }
+
+  close(in[0]);
+  close(out[1]);
+  to_child = fdopen(in[1], "w");
+  from_child = fdopen(out[0], "r");
+  if (to_child == NULL || from_child == NULL) die("fdopen");
+  return pid;
+}
+
+
+// Storms: each touches every directory in turn, so events are spread over the whole tree.
+typedef enum {
+  STORM_CREATE, STORM_MODIFY, STORM_RENAME, STORM_DELETE, STORM_COUNT
+} storm_kind;
+
+static const char* storm_names[STORM_COUNT] = {"create", "modify", "rename", "delete"};
+
+static void storm_path(char* buf, const tree* t, int i, const char* prefix) {
+  snprintf(buf, PATH_MAX, "%s/%s%d", t->dirs[i % t->dir_count], prefix, i);
+}
+
+static void run_storm(const tree* t, storm_kind kind, int ops) {
+  char path[PATH_MAX], target[PATH_MAX];
+  for (int i=0; i<ops; i++) {
+    switch (kind) {
+      case STORM_CREATE:  storm_path(path, t, i, "storm"); touch(path); break;
+      case STORM_MODIFY:  storm_path(path, t, i, "storm"); append(path); break;
+      case STORM_RENAME:
+        storm_path(path, t, i, "storm");
+        storm_path(target, t, i, "renamed");
+        if (rename(path, target) != 0) die(path);
+        break;
+      default:  storm_path(path, t, i, "renamed"); if (unlink(path) != 0) die(path); break;
+    }
+  }
+}
+
+static int compare_u64(const void* p1, const void* p2) {
+  uint64_t a = *(const uint64_t*)p1, b = *(const uint64_t*)p2;
+  return (a > b) - (a < b);
+}
+
+
+int main(int argc, char** argv) {
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  options o = {4, 8, 4, (runtime_dir != NULL && runtime_dir[0] != '\0' ? runtime_dir : "/tmp"), 20000, 1000};
+  int opt;
+  while ((opt = getopt(argc, argv, "d:f:n:t:s:l:")) != -1) {
+    switch (opt) {
+      case 'd':  o.depth = atoi(optarg); break;
+      case 'f':  o.fanout = atoi(optarg); break;
+      case 'n':  o.files = atoi(optarg); break;
+      case 't':  o.tmp_dir = optarg; break;
+      case 's':  o.storm_ops = atoi(optarg); break;
+      case 'l':  o.samples = atoi(optarg); break;
+      default:  fprintf(stderr, USAGE_MSG); return 1;
+    }
+  }
+  if (optind != argc - 1 || o.depth < 0 || o.fanout < 0 || o.files < 0 || o.storm_ops < 0 || o.samples < 0) {
+    fprintf(stderr, USAGE_MSG);
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  char root[PATH_MAX];
+  snprintf(root, PATH_MAX, "%s/fsnotifier-bench.XXXXXX", o.tmp_dir);
+  if (mkdtemp(root) == NULL) die(root);
+
+  tree t = {NULL, 0, 0};
+  uint64_t start = now_ns();
+  build_tree(&t, &o, root, 0);
+  printf("tree: %d directories, %lld files (depth %d, fan-out %d) at %s, built in %.1f ms\n",
+         t.dir_count, (long long)t.dir_count * o.files, o.depth, o.fanout, root, (now_ns() - start) / 1e6);
+
+  pid_t pid = spawn(argv[optind]);
+  pthread_t reader;
+  if (pthread_create(&reader, NULL, &read_output, NULL) != 0) die("pthread_create");
+
+  // registration: from sending ROOTS to its reply, which comes after the walk
+  char command[PATH_MAX + 16];
+  snprintf(command, sizeof(command), "ROOTS\n%s\n#\n", root);
+  start = now_ns();
+  send_command(command);
+  pthread_mutex_lock(&seen.lock);
+  bool registered = await_count(&seen.roots_acks, 1);
+  pthread_mutex_unlock(&seen.lock);
+  uint64_t walk_ns = now_ns() - start;
+  if (!registered || !query_counters()) {
+    fprintf(stderr, "bench: no reply from %s\n", argv[optind]);
+    return 2;
+  }
+  long long watches = counter("watches");
+  printf("walk: %.1f ms end-to-end, %.1f ms in walk (%.2f us per directory), %lld watches\n",
+         walk_ns / 1e6, counter("walk_time") / 1e3, (double)walk_ns / 1e3 / (t.dir_count > 0 ? t.dir_count : 1), watches);
+  printf("memory: watch tree %lld bytes (%.1f per watch), process RSS %ld kB\n",
+         counter("tree_memory"), (double)counter("tree_memory") / (watches > 0 ? watches : 1), rss_kb(pid));
+
+  // throughput: a storm is over when the marker created after it is reported
+  char marker[PATH_MAX + 16];
+  for (int kind=0; kind<STORM_COUNT; kind++) {
+    pthread_mutex_lock(&seen.lock);
+    uint64_t events_before = seen.events, dirty_before = seen.dirty;
+    pthread_mutex_unlock(&seen.lock);
+
+    start = now_ns();
+    run_storm(&t, kind, o.storm_ops);
+    snprintf(marker, sizeof(marker), "%s/marker-%s", root, storm_names[kind]);
+    bool done = await_path(marker);
+    uint64_t elapsed = now_ns() - start;
+
+    pthread_mutex_lock(&seen.lock);
+    uint64_t events = seen.events - events_before, dirty = seen.dirty - dirty_before;
+    pthread_mutex_unlock(&seen.lock);
+    printf("storm %-6s: %d ops, %" PRIu64 " events in %.1f ms, %.0f events/s%s",
+           storm_names[kind], o.storm_ops, events, elapsed / 1e6, events / (elapsed / 1e9), done ? "" : " (timed out)");
+    printf(dirty > 0 ? ", %" PRIu64 " rescans (events lost)\n" : "\n", dirty);
+  }
+
+  // latency: from creating a file to reading its event, one at a time
+  uint64_t* latencies = calloc(o.samples > 0 ? o.samples : 1, sizeof(uint64_t));
+  if (latencies == NULL) die("calloc");
+  int measured = 0;
+  for (int i=0; i<o.samples; i++) {
+    storm_path(marker, &t, i, "latency");
+    start = now_ns();
+    if (await_path(marker)) {
+      latencies[measured++] = now_ns() - start;
+    }
+  }
+  if (measured > 0) {
+    qsort(latencies, measured, sizeof(uint64_t), &compare_u64);
+    printf("latency: %d samples, p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n", measured,
+           latencies[measured / 2] / 1e3, latencies[measured * 9 / 10] / 1e3, latencies[measured * 99 / 100] / 1e3,
+           latencies[measured - 1] / 1e3);
+  }
+  free(latencies);
+
+  if (query_counters()) {
+    printf("counters: %lld events read, %lld emitted, %lld coalesced, %lld overflows, %lld bytes written\n",
+           counter("events_read"), counter("events_emitted"), counter("events_coalesced"), counter("overflows"),
+           counter("bytes_written"));
+  }
+
+  send_command("EXIT\n");
+  fclose(to_child);
+  int status;
+  waitpid(pid, &status, 0);
+  pthread_join(reader, NULL);
+  fclose(from_child);
+
+  nftw(root, &remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+  for (int i=0; i<t.dir_count; i++) free(t.dirs[i]);
+  free(t.dirs);
+  return (WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 3);
+}
@@ -0,0 +1,15 @@
+#!/bin/sh
+
+# Builds the notifier and the benchmark driver into a temporary directory and runs the benchmark;
+# arguments are passed to the driver (see 'bench -h'), e.g. "./bench.sh -d 5 -f 10".
+
+CC_FLAGS="-O2 -Wall -Wextra -Wpedantic -std=c11 -D_DEFAULT_SOURCE -pthread"
+CC=${CC:-clang}
+
+OUT=$(mktemp -d) || exit 1
+trap 'rm -rf "${OUT}"' EXIT
+
+${CC} ${CC_FLAGS} -o "${OUT}/fsnotifier" main.c inotify.c fanotify.c mounts.c exclude.c budget.c poll.c sentinel.c sim.c snapshot.c record.c pool.c trace.c util.c || exit 1
+${CC} ${CC_FLAGS} -o "${OUT}/bench" bench.c || exit 1
+
+"${OUT}/bench" "$@" "${OUT}/fsnotifier"
@@ -0,0 +1,423 @@
+/*
+ * Copyright 2000-2016 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+// The watch budget is the per-user limit minus watches held by other inotify instances of the user.
+// When it does not cover all roots, directories are watched in the order of client-assigned priorities
+// (then depth), and the subtrees left out are "uncovered": reported to the client and polled at a low rate.
+
+typedef struct {
+  int priority;
+  char* path;
+} priority_rule;
+
+typedef struct {
+  int id;
+  char path[];
+} polled_dir;
+
+static array* rules = NULL;
+static array* uncovered = NULL;
+static array* pending = NULL;
+static array* polled = NULL;  // poll roots of uncovered directories, in the same order
+static bool uncovered_changed = false;
+
+
+static bool is_under(const char* parent, int parent_len, const char* path) {
+  return strncmp(parent, path, parent_len) == 0 && (path[parent_len] == '\0' || path[parent_len] == '/');
+}
+
+
+static void delete_rules() {
+  for (int i=0; i<array_size(rules); i++) {
+    priority_rule* rule = array_get(rules, i);
+    free(rule->path);
+    free(rule);
+  }
+  array_delete(rules);
+  rules = NULL;
+}
+
+// "<priority> <path>" lines; higher priorities are watched first
+bool set_priorities(array* lines, bool* changed) {
+  array* new_rules = array_create(array_size(lines) > 0 ? array_size(lines) : 1);
+  CHECK_NULL(new_rules, false);
+
+  for (int i=0; i<array_size(lines); i++) {
+    char* line = array_get(lines, i);
+    char* end;
+    long priority = strtol(line, &end, 10);
+    if (end == line || *end != ' ' || end[1] != '/') {
+      userlog(LOG_WARNING, "invalid priority: %s", line);
+      continue;
+    }
+
+    priority_rule* rule = malloc(sizeof(priority_rule));
+    CHECK_NULL(rule, false);
+    rule->priority = (int)priority;
+    rule->path = strdup(end + 1);
+    CHECK_NULL(rule->path, false);
+    CHECK_NULL(array_push(new_rules, rule), false);
+    userlog(LOG_INFO, "priority %d: %s", rule->priority, rule->path);
+  }
+  array_delete_vs_data(lines);
+
+  *changed = array_size(new_rules) != array_size(rules);
+  for (int i=0; i<array_size(new_rules) && !*changed; i++) {
+    priority_rule* r1 = array_get(new_rules, i);
+    priority_rule* r2 = array_get(rules, i);
+    *changed = r1->priority != r2->priority || strcmp(r1->path, r2->path) != 0;
+  }
+
+  delete_rules();
+  rules = new_rules;
+  return true;
+}
+
+// the priority of the directory's own rule (the closest one above it), raised to the highest rule inside it,
+// so that ancestors of a valuable subtree are never outranked by the subtree itself
+int path_priority(const char* path) {
+  int path_len = strlen(path);
+  int own = 0, own_len = -1;
+  int inner = INT_MIN;
+
+  for (int i=0; i<array_size(rules); i++) {
+    priority_rule* rule = array_get(rules, i);
+    int rule_len = strlen(rule->path);
+    if (is_under(rule->path, rule_len, path)) {
+      if (rule_len > own_len) {
+        own = rule->priority;
+        own_len = rule_len;
+      }
+    }
+    else if (is_under(path, path_len, rule->path) && rule->priority > inner) {
+      inner = rule->priority;
+    }
+  }
+
+  return (inner > own ? inner : own);
+}
+
+
+// sums up "inotify wd:" records of every inotify descriptor held by other processes of the current user
+// (this one's are known without parsing, and its sentinel watches are not to shrink the budget)
+static int user_watch_count() {
+  DIR* proc = opendir("/proc");
+  if (proc == NULL) {
+    userlog(LOG_WARNING, "opendir(/proc): %s", strerror(errno));
+    return -1;
+  }
+
+  uid_t uid = getuid();
+  int count = 0;
+  char path[PATH_MAX], link[64], line[256], self[16];
+  snprintf(self, sizeof(self), "%d", (int)getpid());
+
+  struct dirent* pid_entry;
+  while ((pid_entry = readdir(proc)) != NULL) {
+    if (pid_entry->d_name[0] < '0' || pid_entry->d_name[0] > '9' || strcmp(pid_entry->d_name, self) == 0) continue;
+
+    struct stat st;
+    if (fstatat(dirfd(proc), pid_entry->d_name, &st, 0) != 0 || st.st_uid != uid) continue;
+
+    snprintf(path, sizeof(path), "/proc/%s/fd", pid_entry->d_name);
+    DIR* fds = opendir(path);
+    if (fds == NULL) continue;
+
+    struct dirent* fd_entry;
+    while ((fd_entry = readdir(fds)) != NULL) {
+      ssize_t len = readlinkat(dirfd(fds), fd_entry->d_name, link, sizeof(link) - 1);
+      if (len <= 0) continue;
+      link[len] = '\0';
+      if (strcmp(link, "anon_inode:inotify") != 0) continue;
+
+      snprintf(path, sizeof(path), "/proc/%s/fdinfo/%s", pid_entry->d_name, fd_entry->d_name);
+      FILE* info = fopen(path, "r");
+      if (info == NULL) continue;
+      while (fgets(line, sizeof(line), info) != NULL) {
+        if (strncmp(line, "inotify wd:", 11) == 0) {
+          count++;
+        }
+      }
+      fclose(info);
+    }
+    closedir(fds);
+  }
+
+  closedir(proc);
+  return count;
+}
+
+int watch_budget(int own_watches) {
+  int limit = get_watch_limit();
+  int used = user_watch_count();
+  if (used < 0) {
+    return limit;
+  }
+  int budget = limit - used;
+  userlog(LOG_INFO, "watch budget: %d (limit %d, used by others %d, own %d)", budget, limit, used, own_watches);
+  return (budget > 0 ? budget : 0);
+}
+
+
+// Uncovered paths are kept sorted with '/' ordered before any other character, so that a subtree
+// follows its top directory and a covering entry is found by binary search. None is under another one.
+// Additions are collected in `pending` and merged in one go (a budget running out adds many at once).
+
+static int compare_paths(const char* path1, const char* path2) {
+  while (*path1 != '\0' && *path1 == *path2) {
+    path1++;
+    path2++;
+  }
+  int c1 = (*path1 == '/' ? 1 : (unsigned char)*path1 + (*path1 != '\0'));
+  int c2 = (*path2 == '/' ? 1 : (unsigned char)*path2 + (*path2 != '\0'));
+  return c1 - c2;
+}
+
+static int compare_uncovered(const void* p1, const void* p2) {
+  return compare_paths(*(char**)p1, *(char**)p2);
+}
+
+// matches the entry the path is under
+static int compare_covering(const void* key, const void* p) {
+  const char* path = key;
+  const char* entry = *(char**)p;
+  return is_parent_path(entry, path) ? 0 : compare_paths(path, entry);
+}
+
+static bool merge_pending() {
+  if (array_size(pending) == 0) {
+    return true;
+  }
+  array_sort(pending, &compare_uncovered);
+
+  int n = array_size(uncovered), m = array_size(pending);
+  array* merged = array_create(n + m);
+  CHECK_NULL(merged, false);
+  const char* last = NULL;
+  for (int i=0, j=0; i<n || j<m; ) {
+    bool added = i == n || (j < m && compare_paths(array_get(pending, j), array_get(uncovered, i)) < 0);
+    char* path = (added ? array_get(pending, j++) : array_get(uncovered, i++));
+    if (last != NULL && is_parent_path(last, path)) {
+      free(path);
+      continue;
+    }
+    if (added) {
+      userlog(LOG_INFO, "uncovered: %s", path);
+    }
+    array_push(merged, path);
+    last = path;
+  }
+
+  array_delete(uncovered);
+  array_delete(pending);
+  uncovered = merged;
+  pending = NULL;
+  uncovered_changed = true;
+  return true;
+}
+
+// drops entries under `parent`, keeping the order
+static void remove_under(const char* parent, array* removed) {
+  int parent_len = strlen(parent), kept = 0;
+  for (int i=0; i<array_size(uncovered); i++) {
+    char* path = array_get(uncovered, i);
+    if (is_under(parent, parent_len, path)) {
+      array_push(removed, path);
+    }
+    else {
+      array_put(uncovered, kept++, path);
+    }
+  }
+  while (array_size(uncovered) > kept) {
+    array_pop(uncovered);
+  }
+}
+
+void uncovered_clear() {
+  if (array_size(uncovered) > 0 || array_size(pending) > 0) {
+    uncovered_changed = true;
+  }
+  array_delete_vs_data(uncovered);
+  array_delete_vs_data(pending);
+  uncovered = pending = NULL;
+}
+
+bool uncovered_add(const char* path) {
+  if (array_bsearch(uncovered, path, &compare_covering) != NULL) {
+    return true;
+  }
+  if (pending == NULL) {
+    pending = array_create(16);
+    CHECK_NULL(pending, false);
+  }
+  char* copy = strdup(path);
+  CHECK_NULL(copy, false);
+  CHECK_NULL(array_push(pending, copy), false);
+  return true;
+}
+
+// follows a renamed directory: uncovered paths below it are re-based onto the new location
+void uncovered_move(const char* from, const char* to) {
+  if (!merge_pending()) {
+    return;
+  }
+  array* moved = array_create(4);
+  if (moved == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    return;
+  }
+  remove_under(from, moved);
+
+  int from_len = strlen(from), to_len = strlen(to);
+  for (int i=0; i<array_size(moved); i++) {
+    char* path = array_get(moved, i);
+    int tail_len = strlen(path + from_len);
+    char* new_path = malloc(to_len + tail_len + 1);
+    if (new_path == NULL) {
+      userlog(LOG_ERR, "out of memory");
+      break;
+    }
+    memcpy(new_path, to, to_len);
+    memcpy(new_path + to_len, path + from_len, tail_len + 1);
+    userlog(LOG_INFO, "uncovered: %s (was %s)", new_path, path);
+    if (!uncovered_add(new_path)) {
+      free(new_path);
+      break;
+    }
+    free(new_path);
+  }
+  if (array_size(moved) > 0) {
+    uncovered_changed = true;
+  }
+  array_delete_vs_data(moved);
+  merge_pending();
+}
+
+// forgets uncovered paths of a root which is no longer watched
+void uncovered_remove_under(const char* root) {
+  if (!merge_pending()) {
+    return;
+  }
+  array* removed = array_create(4);
+  if (removed == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    return;
+  }
+  remove_under(root, removed);
+  for (int i=0; i<array_size(removed); i++) {
+    userlog(LOG_INFO, "uncovered path dropped: %s", (char*)array_get(removed, i));
+    uncovered_changed = true;
+  }
+  array_delete_vs_data(removed);
+}
+
+int uncovered_count() {
+  merge_pending();
+  return array_size(uncovered);
+}
+
+const char* uncovered_get(int i) {
+  return array_get(uncovered, i);
+}
+
+bool take_uncovered_changes() {
+  merge_pending();
+  bool result = uncovered_changed;
+  uncovered_changed = false;
+  return result;
+}
+
+
+// subtrees which are gone are dropped (their poll roots go with the next poll_uncovered())
+void drop_gone_uncovered() {
+  merge_pending();
+  int kept = 0;
+  for (int i=0; i<array_size(uncovered); i++) {
+    char* path = array_get(uncovered, i);
+    struct stat st;
+    if (stat(path, &st) != 0) {
+      userlog(LOG_INFO, "uncovered directory is gone: %s", path);
+      free(path);
+      uncovered_changed = true;
+      continue;
+    }
+    array_put(uncovered, kept++, path);
+  }
+  while (array_size(uncovered) > kept) {
+    array_pop(uncovered);
+  }
+}
+
+// Uncovered subtrees are re-read by the polling engine in the background (see poll.c), which reports
+// their changes as it does for unwatchable mounts. Both lists are sorted, so they are synced by one merge.
+void poll_uncovered() {
+  merge_pending();
+  int n = array_size(uncovered), m = array_size(polled);
+  array* next = array_create(n > 0 ? n : 1);
+  if (next == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    return;
+  }
+
+  for (int i=0, j=0; i<n || j<m; ) {
+    polled_dir* dir = (j < m ? array_get(polled, j) : NULL);
+    int c = (i == n ? 1 : dir == NULL ? -1 : compare_paths(array_get(uncovered, i), dir->path));
+    if (c == 0) {
+      array_push(next, dir);
+      i++, j++;
+    }
+    else if (c > 0) {
+      poll_unwatch(dir->id);
+      free(dir);
+      j++;
+    }
+    else {
+      const char* path = array_get(uncovered, i++);
+      int len = strlen(path);
+      int id = poll_watch_uncovered(path);
+      polled_dir* added = (id >= 0 ? malloc(sizeof(polled_dir) + len + 1) : NULL);
+      if (added == NULL) {
+        if (id >= 0) poll_unwatch(id);
+        continue;
+      }
+      added->id = id;
+      memcpy(added->path, path, len + 1);
+      array_push(next, added);
+    }
+  }
+
+  array_delete(polled);
+  polled = next;
+}
+
+void close_budget() {
+  delete_rules();
+  uncovered_clear();
+  array_delete_vs_data(polled);  // poll roots are gone with close_polling()
+  polled = NULL;
+}
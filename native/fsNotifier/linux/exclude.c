@@ -0,0 +1,331 @@
+/*
+ * Copyright 2000-2016 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+// Exclusion patterns are globs: '?' and '*' match within a path component, '**' matches across components.
+// A pattern without a slash is matched against a directory name (plain names go into a sorted set),
+// one starting with a slash against the full path, and any other against trailing components of the path.
+// Each kind of glob is compiled into a single NFA which is simulated over bit sets of states.
+// Patterns are read by walk and poll threads, hence the lock.
+
+typedef enum {
+  TOKEN_CHAR,
+  TOKEN_ANY,    // ?
+  TOKEN_STAR,   // *
+  TOKEN_PATH,   // ** (at the end of a pattern)
+  TOKEN_DIRS,   // **/ (zero or more directories)
+  TOKEN_MATCH   // end of a pattern
+} token_type;
+
+typedef struct {
+  token_type type;
+  char c;
+} nfa_token;
+
+typedef struct {
+  nfa_token* tokens;
+  int size;
+  int capacity;
+  uint64_t* initial;
+  int words;
+} nfa;
+
+static array* names = NULL;
+static nfa name_nfa = {0};
+static nfa path_nfa = {0};
+static array* patterns = NULL;
+static pthread_rwlock_t patterns_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+static bool nfa_append(nfa* a, token_type type, char c) {
+  if (a->size == a->capacity) {
+    int new_cap = (a->capacity > 0 ? a->capacity * 2 : 64);
+    nfa_token* new_tokens = realloc(a->tokens, sizeof(nfa_token) * new_cap);
+    CHECK_NULL(new_tokens, false);
+    a->tokens = new_tokens;
+    a->capacity = new_cap;
+  }
+  a->tokens[a->size].type = type;
+  a->tokens[a->size].c = c;
+  a->size++;
+  return true;
+}
+
+// a floating pattern may start at any component, as if prefixed with '**/'
+static bool nfa_add_pattern(nfa* a, const char* pattern, int len, bool floating) {
+  if (floating && !nfa_append(a, TOKEN_DIRS, 0)) {
+    return false;
+  }
+  for (int i=0; i<len; i++) {
+    bool ok;
+    if (pattern[i] == '*' && i + 1 < len && pattern[i + 1] == '*') {
+      if (i + 2 < len && pattern[i + 2] == '/') {
+        ok = nfa_append(a, TOKEN_DIRS, 0);
+        i += 2;
+      }
+      else {
+        ok = nfa_append(a, TOKEN_PATH, 0);
+        i++;
+      }
+    }
+    else if (pattern[i] == '*') {
+      ok = nfa_append(a, TOKEN_STAR, 0);
+    }
+    else if (pattern[i] == '?') {
+      ok = nfa_append(a, TOKEN_ANY, 0);
+    }
+    else {
+      ok = nfa_append(a, TOKEN_CHAR, pattern[i]);
+    }
+    if (!ok) return false;
+  }
+  return nfa_append(a, TOKEN_MATCH, 0);
+}
+
+static void set_bit(uint64_t* bits, int i) {
+  bits[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
+static bool get_bit(const uint64_t* bits, int i) {
+  return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+// `active` states may be left by skipping a wildcard (`open`), unless they are inside a '**/' run
+static void nfa_closure(nfa* a, uint64_t* active, uint64_t* open) {
+  for (int i=0; i<a->size; i++) {
+    token_type type = a->tokens[i].type;
+    if (get_bit(open, i) && (type == TOKEN_STAR || type == TOKEN_PATH || type == TOKEN_DIRS)) {
+      set_bit(active, i + 1);
+      set_bit(open, i + 1);
+    }
+  }
+}
+
+static bool nfa_compile(nfa* a) {
+  a->words = (a->size + 64) / 64;
+  a->initial = calloc(a->words, sizeof(uint64_t));
+  CHECK_NULL(a->initial, false);
+
+  uint64_t open[a->words];
+  memset(open, 0, sizeof(open));
+  for (int i=0; i<a->size; i++) {
+    if (i == 0 || a->tokens[i - 1].type == TOKEN_MATCH) {
+      set_bit(a->initial, i);
+      set_bit(open, i);
+    }
+  }
+  nfa_closure(a, a->initial, open);
+  return true;
+}
+
+static void nfa_step(nfa* a, uint64_t* active, char c) {
+  uint64_t next[a->words], open[a->words];
+  memset(next, 0, sizeof(next));
+  memset(open, 0, sizeof(open));
+
+  for (int w=0; w<a->words; w++) {
+    for (uint64_t bits = active[w]; bits != 0; bits &= bits - 1) {
+      int i = w * 64 + __builtin_ctzll(bits);
+      nfa_token* t = &a->tokens[i];
+      switch (t->type) {
+        case TOKEN_CHAR:
+          if (c == t->c) { set_bit(next, i + 1); set_bit(open, i + 1); }
+          break;
+        case TOKEN_ANY:
+          if (c != '/') { set_bit(next, i + 1); set_bit(open, i + 1); }
+          break;
+        case TOKEN_STAR:
+          if (c != '/') { set_bit(next, i); set_bit(open, i); }
+          break;
+        case TOKEN_PATH:
+          set_bit(next, i); set_bit(open, i);
+          break;
+        case TOKEN_DIRS:
+          set_bit(next, i);
+          if (c == '/') { set_bit(next, i + 1); set_bit(open, i + 1); }
+          break;
+        case TOKEN_MATCH:
+          break;
+      }
+    }
+  }
+
+  nfa_closure(a, next, open);
+  memcpy(active, next, sizeof(next));
+}
+
+static bool nfa_accepts(nfa* a, uint64_t* active) {
+  for (int w=0; w<a->words; w++) {
+    for (uint64_t bits = active[w]; bits != 0; bits &= bits - 1) {
+      if (a->tokens[w * 64 + __builtin_ctzll(bits)].type == TOKEN_MATCH) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static bool nfa_dead(nfa* a, uint64_t* active) {
+  for (int w=0; w<a->words; w++) {
+    if (active[w] != 0) return false;
+  }
+  return true;
+}
+
+static void nfa_feed(nfa* a, uint64_t* active, const char* s, int len) {
+  for (int i=0; i<len && !nfa_dead(a, active); i++) {
+    nfa_step(a, active, s[i]);
+  }
+}
+
+static void nfa_free(nfa* a) {
+  free(a->tokens);
+  free(a->initial);
+  memset(a, 0, sizeof(nfa));
+}
+
+
+static int compare_strings(const void* p1, const void* p2) {
+  return strcmp(*(char**)p1, *(char**)p2);
+}
+
+static bool same_patterns(array* new_patterns) {
+  if (array_size(patterns) != array_size(new_patterns)) {
+    return false;
+  }
+  for (int i=0; i<array_size(patterns); i++) {
+    if (strcmp(array_get(patterns, i), array_get(new_patterns, i)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void clear_patterns() {
+  array_delete(names);
+  names = NULL;
+  nfa_free(&name_nfa);
+  nfa_free(&path_nfa);
+  array_delete_vs_data(patterns);
+  patterns = NULL;
+}
+
+static bool compile_patterns(array* new_patterns, bool* changed) {
+  for (int i=0; i<array_size(new_patterns); i++) {
+    char* pattern = array_get(new_patterns, i);
+    int len = strlen(pattern);
+    while (len > 1 && pattern[len - 1] == '/') {
+      pattern[--len] = '\0';
+    }
+  }
+  array_sort(new_patterns, &compare_strings);
+  *changed = !same_patterns(new_patterns);
+  if (!*changed) {
+    array_delete_vs_data(new_patterns);
+    return true;
+  }
+
+  clear_patterns();
+  patterns = new_patterns;
+  names = array_create(array_size(patterns) > 0 ? array_size(patterns) : 1);
+  CHECK_NULL(names, false);
+
+  for (int i=0; i<array_size(patterns); i++) {
+    char* pattern = array_get(patterns, i);
+    int len = strlen(pattern);
+    userlog(LOG_INFO, "exclude: %s", pattern);
+
+    bool ok;
+    if (strchr(pattern, '/') != NULL) {
+      ok = nfa_add_pattern(&path_nfa, pattern, len, pattern[0] != '/');
+    }
+    else if (strpbrk(pattern, "*?") != NULL) {
+      ok = nfa_add_pattern(&name_nfa, pattern, len, false);
+    }
+    else {
+      ok = array_push(names, pattern) != NULL;
+    }
+    if (!ok) {
+      clear_patterns();
+      return false;
+    }
+  }
+
+  return (name_nfa.size == 0 || nfa_compile(&name_nfa)) && (path_nfa.size == 0 || nfa_compile(&path_nfa));
+}
+
+bool set_exclude_patterns(array* new_patterns, bool* changed) {
+  pthread_rwlock_wrlock(&patterns_lock);
+  bool result = compile_patterns(new_patterns, changed);
+  pthread_rwlock_unlock(&patterns_lock);
+  return result;
+}
+
+static bool match_patterns(const char* parent, int parent_len, const char* name) {
+  if (array_size(names) > 0 && array_bsearch(names, &name, &compare_strings) != NULL) {
+    return true;
+  }
+
+  int name_len = strlen(name);
+  if (name_nfa.size > 0) {
+    uint64_t active[name_nfa.words];
+    memcpy(active, name_nfa.initial, sizeof(active));
+    nfa_feed(&name_nfa, active, name, name_len);
+    if (nfa_accepts(&name_nfa, active)) {
+      return true;
+    }
+  }
+
+  if (path_nfa.size > 0) {
+    uint64_t active[path_nfa.words];
+    memcpy(active, path_nfa.initial, sizeof(active));
+    nfa_feed(&path_nfa, active, parent, parent_len);
+    nfa_feed(&path_nfa, active, "/", 1);
+    nfa_feed(&path_nfa, active, name, name_len);
+    if (nfa_accepts(&path_nfa, active)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool is_excluded_dir(const char* parent, int parent_len, const char* name) {
+  pthread_rwlock_rdlock(&patterns_lock);
+  bool result = match_patterns(parent, parent_len, name);
+  pthread_rwlock_unlock(&patterns_lock);
+  return result;
+}
+
+// whether any pattern depends on more than a directory's own name
+bool has_path_patterns() {
+  pthread_rwlock_rdlock(&patterns_lock);
+  bool result = path_nfa.size > 0;
+  pthread_rwlock_unlock(&patterns_lock);
+  return result;
+}
+
+void clear_exclude_patterns() {
+  pthread_rwlock_wrlock(&patterns_lock);
+  clear_patterns();
+  pthread_rwlock_unlock(&patterns_lock);
+}
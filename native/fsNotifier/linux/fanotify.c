@@ -0,0 +1,551 @@
+/*
+ * Copyright 2000-2016 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE  // open_by_handle_at()
+
+#include "fsnotifier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#if __has_include(<sys/fanotify.h>)
+#include <sys/fanotify.h>
+#endif
+
+#ifdef FAN_REPORT_DFID_NAME
+
+// One filesystem-wide mark covers every root on that filesystem; events are matched against roots in user space.
+// Resolving a directory handle to a path takes open_by_handle_at() + readlink(), hence a small cache
+// which is flushed whenever a directory is moved or deleted. A directory may be gone by the time its events
+// are read; roots on that filesystem are then reported dirty, as after an overflow.
+
+#define FAN_EVENT_MASK (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MODIFY | FAN_ATTRIB | \
+                        FAN_DELETE_SELF | FAN_MOVE_SELF | FAN_ONDIR)
+
+#define FAN_BUF_LEN (64 * 1024)
+#define HANDLE_CACHE_SIZE 256
+#define MAX_HANDLE_BYTES 128
+
+typedef struct {
+  fsid_t fsid;
+  char* path;
+  int mount_fd;
+  int refs;
+} fs_mark;
+
+typedef struct {
+  char* path;
+  bool recursive;
+  bool dirty;  // got events which could not be resolved to a path
+  array* marks;
+} fan_root;
+
+typedef struct {
+  fsid_t fsid;
+  int handle_type;
+  unsigned int handle_bytes;
+  unsigned char handle[MAX_HANDLE_BYTES];
+  char* path;
+} cached_handle;
+
+static int fanotify_fd = -1;
+static array* marks = NULL;
+static array* fan_roots = NULL;
+static cached_handle handle_cache[HANDLE_CACHE_SIZE];
+static void (* callback)(const char*, int) = NULL;
+
+static char fan_buf[FAN_BUF_LEN] __attribute__((aligned(8)));
+static char path_buf[2 * PATH_MAX];
+
+
+bool init_fanotify() {
+  fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY | O_LARGEFILE);
+  if (fanotify_fd < 0) {
+    userlog(LOG_INFO, "fanotify_init: %s", strerror(errno));
+    return false;
+  }
+
+  marks = array_create(5);
+  fan_roots = array_create(20);
+  if (marks == NULL || fan_roots == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    close_fanotify();
+    return false;
+  }
+
+  userlog(LOG_INFO, "fanotify fd: %d", fanotify_fd);
+  return true;
+}
+
+void set_fanotify_callback(void (* _callback)(const char*, int)) {
+  callback = _callback;
+}
+
+int get_fanotify_fd() {
+  return fanotify_fd;
+}
+
+
+static void flush_handle_cache() {
+  for (int i=0; i<HANDLE_CACHE_SIZE; i++) {
+    free(handle_cache[i].path);
+    handle_cache[i].path = NULL;
+  }
+}
+
+static fs_mark* add_mark(const char* path) {
+  struct statfs st;
+  if (statfs(path, &st) != 0) {
+    userlog(LOG_INFO, "statfs(%s): %s", path, strerror(errno));
+    return NULL;
+  }
+
+  for (int i=0; i<array_size(marks); i++) {
+    fs_mark* mark = array_get(marks, i);
+    if (mark != NULL && memcmp(&mark->fsid, &st.f_fsid, sizeof(fsid_t)) == 0) {
+      mark->refs++;
+      return mark;
+    }
+  }
+
+  if (fanotify_mark(fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FAN_EVENT_MASK, AT_FDCWD, path) != 0) {
+    userlog(LOG_INFO, "fanotify_mark(%s): %s", path, strerror(errno));
+    return NULL;
+  }
+
+  fs_mark* mark = calloc(1, sizeof(fs_mark));
+  CHECK_NULL(mark, NULL);
+  mark->fsid = st.f_fsid;
+  mark->path = strdup(path);
+  mark->mount_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  mark->refs = 1;
+  if (mark->path == NULL || mark->mount_fd < 0) {
+    userlog(LOG_INFO, "open(%s): %s", path, strerror(errno));
+    fanotify_mark(fanotify_fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, FAN_EVENT_MASK, AT_FDCWD, path);
+    free(mark->path);
+    free(mark);
+    return NULL;
+  }
+  CHECK_NULL(array_push(marks, mark), NULL);
+
+  userlog(LOG_INFO, "fanotify mark: %s", path);
+  return mark;
+}
+
+static void release_mark(fs_mark* mark) {
+  if (--mark->refs > 0) {
+    return;
+  }
+
+  userlog(LOG_INFO, "fanotify unmark: %s", mark->path);
+  if (fanotify_mark(fanotify_fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, FAN_EVENT_MASK, AT_FDCWD, mark->path) != 0) {
+    userlog(LOG_DEBUG, "fanotify_mark(%s): %s", mark->path, strerror(errno));
+  }
+  close(mark->mount_fd);
+
+  for (int i=0; i<array_size(marks); i++) {
+    if (array_get(marks, i) == mark) {
+      array_put(marks, i, NULL);
+      break;
+    }
+  }
+  free(mark->path);
+  free(mark);
+  flush_handle_cache();
+}
+
+static bool is_excluded(const char* mount, array* mounts) {
+  for (int i=0; i<array_size(mounts); i++) {
+    if (is_parent_path(array_get(mounts, i), mount)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// marks the root's filesystem and the ones mounted beneath it (except unwatchable `mounts`)
+static bool mark_root(fan_root* root, array* mounts) {
+  fs_mark* mark = add_mark(root->path);
+  if (mark == NULL) {
+    return false;
+  }
+  CHECK_NULL(array_push(root->marks, mark), false);
+
+  if (!root->recursive) {
+    return true;
+  }
+
+  array* nested = array_create(5);
+  CHECK_NULL(nested, false);
+  bool result = collect_mounts(root->path, true, nested);
+  for (int i=0; result && i<array_size(nested); i++) {
+    char* mount = array_get(nested, i);
+    if (is_excluded(mount, mounts)) continue;
+    mark = add_mark(mount);
+    if (mark == NULL) {
+      result = false;
+    }
+    else if (array_push(root->marks, mark) == NULL) {
+      release_mark(mark);
+      result = false;
+    }
+  }
+
+  array_delete_vs_data(nested);
+  return result;
+}
+
+static void delete_root(fan_root* root) {
+  for (int i=0; i<array_size(root->marks); i++) {
+    release_mark(array_get(root->marks, i));
+  }
+  array_delete(root->marks);
+  free(root->path);
+  free(root);
+}
+
+int fanotify_watch(const char* path, array* mounts) {
+  bool recursive = true;
+  if (path[0] == '|') {
+    path++;
+    recursive = false;
+  }
+
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    if (errno == ENOENT) {
+      return ERR_MISSING;
+    }
+    userlog(LOG_INFO, "stat(%s): %s", path, strerror(errno));
+    return ERR_UNSUPPORTED;
+  }
+  if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+    userlog(LOG_WARNING, "unexpected node type: %s, %d", path, st.st_mode);
+    return ERR_IGNORE;
+  }
+
+  fan_root* root = calloc(1, sizeof(fan_root));
+  CHECK_NULL(root, ERR_ABORT);
+  root->path = strdup(path);
+  root->recursive = recursive && S_ISDIR(st.st_mode);
+  root->marks = array_create(2);
+  if (root->path == NULL || root->marks == NULL) {
+    free(root->path);
+    free(root);
+    userlog(LOG_ERR, "out of memory");
+    return ERR_ABORT;
+  }
+
+  if (!mark_root(root, mounts)) {
+    delete_root(root);
+    return ERR_UNSUPPORTED;
+  }
+
+  for (int i=0; i<array_size(fan_roots); i++) {
+    if (array_get(fan_roots, i) == NULL) {
+      array_put(fan_roots, i, root);
+      return i;
+    }
+  }
+  CHECK_NULL(array_push(fan_roots, root), ERR_ABORT);
+  return array_size(fan_roots) - 1;
+}
+
+void fanotify_unwatch(int id) {
+  fan_root* root = array_get(fan_roots, id);
+  if (root != NULL) {
+    array_put(fan_roots, id, NULL);
+    delete_root(root);
+  }
+}
+
+
+static fs_mark* find_mark(fsid_t* fsid) {
+  for (int i=0; i<array_size(marks); i++) {
+    fs_mark* mark = array_get(marks, i);
+    if (mark != NULL && memcmp(&mark->fsid, fsid, sizeof(fsid_t)) == 0) {
+      return mark;
+    }
+  }
+  return NULL;
+}
+
+static unsigned int hash_handle(struct file_handle* handle) {
+  unsigned int h = handle->handle_type;
+  for (unsigned int i=0; i<handle->handle_bytes; i++) {
+    h = h * 31 + handle->f_handle[i];
+  }
+  return h % HANDLE_CACHE_SIZE;
+}
+
+// resolves a directory handle into `path_buf`; returns path length or -1
+static int resolve_handle(fsid_t* fsid, struct file_handle* handle) {
+  cached_handle* entry = NULL;
+  if (handle->handle_bytes <= MAX_HANDLE_BYTES) {
+    entry = &handle_cache[hash_handle(handle)];
+    if (entry->path != NULL && memcmp(&entry->fsid, fsid, sizeof(fsid_t)) == 0 &&
+        entry->handle_type == handle->handle_type && entry->handle_bytes == handle->handle_bytes &&
+        memcmp(entry->handle, handle->f_handle, handle->handle_bytes) == 0) {
+      int len = strlen(entry->path);
+      memcpy(path_buf, entry->path, len + 1);
+      return len;
+    }
+  }
+
+  fs_mark* mark = find_mark(fsid);
+  if (mark == NULL) {
+    return -1;
+  }
+
+  int fd = open_by_handle_at(mark->mount_fd, handle, O_PATH | O_CLOEXEC);
+  if (fd < 0) {
+    userlog(LOG_DEBUG, "open_by_handle_at: %s", strerror(errno));
+    return -1;
+  }
+
+  char link[64];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t len = readlink(link, path_buf, PATH_MAX - 1);
+  close(fd);
+  if (len <= 0) {
+    return -1;
+  }
+  path_buf[len] = '\0';
+  if (len > 10 && strcmp(path_buf + len - 10, " (deleted)") == 0) {
+    return -1;
+  }
+
+  if (entry != NULL) {
+    free(entry->path);
+    entry->path = strdup(path_buf);
+    entry->fsid = *fsid;
+    entry->handle_type = handle->handle_type;
+    entry->handle_bytes = handle->handle_bytes;
+    memcpy(entry->handle, handle->f_handle, handle->handle_bytes);
+  }
+  return len;
+}
+
+static bool is_watched(const char* path) {
+  for (int i=0; i<array_size(fan_roots); i++) {
+    fan_root* root = array_get(fan_roots, i);
+    if (root == NULL) continue;
+    if (root->recursive ? is_parent_path(root->path, path) : strcmp(root->path, path) == 0) {
+      return true;
+    }
+    if (!root->recursive) {
+      const char* slash = strrchr(path, '/');
+      int root_len = strlen(root->path);
+      if (slash != NULL && slash - path == root_len && strncmp(root->path, path, root_len) == 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static bool is_root(const char* path) {
+  for (int i=0; i<array_size(fan_roots); i++) {
+    fan_root* root = array_get(fan_roots, i);
+    if (root != NULL && strcmp(root->path, path) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void mark_dirty(fsid_t* fsid) {
+  fs_mark* mark = find_mark(fsid);
+  for (int i=0; i<array_size(fan_roots); i++) {
+    fan_root* root = array_get(fan_roots, i);
+    if (root == NULL) continue;
+    for (int j=0; j<array_size(root->marks); j++) {
+      if (array_get(root->marks, j) == mark) {
+        root->dirty = true;
+        break;
+      }
+    }
+  }
+}
+
+static int inotify_mask(uint64_t mask) {
+  int result = 0;
+  if (mask & FAN_CREATE) result |= IN_CREATE;
+  if (mask & FAN_DELETE) result |= IN_DELETE;
+  if (mask & FAN_MOVED_FROM) result |= IN_MOVED_FROM;
+  if (mask & FAN_MOVED_TO) result |= IN_MOVED_TO;
+  if (mask & FAN_MODIFY) result |= IN_MODIFY;
+  if (mask & FAN_ATTRIB) result |= IN_ATTRIB;
+  if (mask & FAN_DELETE_SELF) result |= IN_DELETE_SELF;
+  if (mask & FAN_MOVE_SELF) result |= IN_MOVE_SELF;
+  if (mask & FAN_ONDIR) result |= IN_ISDIR;
+  return result;
+}
+
+static void process_fanotify_event(struct fanotify_event_metadata* event, char* data) {
+  struct fanotify_event_info_fid* fid = NULL;
+  for (size_t pos = event->metadata_len; pos + sizeof(struct fanotify_event_info_header) <= event->event_len; ) {
+    struct fanotify_event_info_header* hdr = (struct fanotify_event_info_header*)(data + pos);
+    if (hdr->len == 0) break;
+    if (hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME || hdr->info_type == FAN_EVENT_INFO_TYPE_DFID ||
+        hdr->info_type == FAN_EVENT_INFO_TYPE_FID) {
+      fid = (struct fanotify_event_info_fid*)hdr;
+      break;
+    }
+    pos += hdr->len;
+  }
+  if (fid == NULL) {
+    return;
+  }
+
+  struct file_handle* handle = (struct file_handle*)fid->handle;
+  int path_len = resolve_handle((fsid_t*)&fid->fsid, handle);
+  if (path_len < 0) {
+    mark_dirty((fsid_t*)&fid->fsid);
+    return;
+  }
+
+  if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+    const char* name = (const char*)(handle->f_handle + handle->handle_bytes);
+    if (strcmp(name, ".") != 0) {
+      int name_len = strlen(name);
+      if (path_len + name_len + 2 > (int)sizeof(path_buf)) {
+        return;
+      }
+      path_buf[path_len] = '/';
+      memcpy(path_buf + path_len + 1, name, name_len + 1);
+    }
+  }
+
+  int mask = inotify_mask(event->mask);
+  userlog(LOG_DEBUG, "fanotify: mask=%llx path=%s", (unsigned long long)event->mask, path_buf);
+
+  if ((mask & (IN_CREATE | IN_MOVED_TO)) && (mask & (IN_DELETE | IN_MOVED_FROM))) {
+    // merged events lose their order, the current state tells which one came last
+    struct stat st;
+    mask &= (lstat(path_buf, &st) == 0 ? ~(IN_DELETE | IN_MOVED_FROM) : ~(IN_CREATE | IN_MOVED_TO));
+  }
+  if ((mask & IN_ISDIR) && (mask & (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF))) {
+    flush_handle_cache();
+  }
+  if ((mask & (IN_DELETE | IN_MOVED_FROM)) && is_root(path_buf)) {
+    mask = IN_DELETE_SELF;  // a root itself went away, the client is notified on its removal
+  }
+  else if (mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+    return;  // reported by the parent directory already
+  }
+
+  if (is_watched(path_buf) && callback != NULL) {
+    (*callback)(path_buf, mask);
+  }
+}
+
+bool process_fanotify_input() {
+  bool overflow = false;
+
+  while (true) {
+    ssize_t len = read(fanotify_fd, fan_buf, FAN_BUF_LEN);
+    if (len < 0) {
+      if (errno == EAGAIN) {
+        break;
+      }
+      else if (errno == EINTR) {
+        continue;
+      }
+      userlog(LOG_ERR, "read: %s", strerror(errno));
+      return false;
+    }
+
+    // records are only 4-byte aligned, so the header is copied out
+    struct fanotify_event_metadata event;
+    for (char* p = fan_buf; p + sizeof(event) <= fan_buf + len; p += event.event_len) {
+      memcpy(&event, p, sizeof(event));
+      if (event.event_len < sizeof(event) || p + event.event_len > fan_buf + len) {
+        break;
+      }
+      if (event.vers != FANOTIFY_METADATA_VERSION) {
+        userlog(LOG_ERR, "fanotify: unexpected metadata version %d", event.vers);
+        return false;
+      }
+      if (event.mask & FAN_Q_OVERFLOW) {
+        userlog(LOG_INFO, "fanotify event queue overflow");
+        overflow = true;
+      }
+      else {
+        process_fanotify_event(&event, p);
+      }
+      if (event.fd >= 0) {
+        close(event.fd);
+      }
+    }
+  }
+
+  for (int i=0; i<array_size(fan_roots); i++) {
+    fan_root* root = array_get(fan_roots, i);
+    if (root != NULL && root->dirty) {
+      root->dirty = false;
+      if (!overflow && callback != NULL) {
+        userlog(LOG_INFO, "fanotify: unresolved events under %s", root->path);
+        (*callback)(root->path, IN_Q_OVERFLOW);
+      }
+    }
+  }
+
+  if (overflow && callback != NULL) {
+    (*callback)("", IN_Q_OVERFLOW);
+  }
+  return true;
+}
+
+
+void close_fanotify() {
+  for (int i=0; i<array_size(fan_roots); i++) {
+    fanotify_unwatch(i);
+  }
+  array_delete(fan_roots);
+  array_delete(marks);
+  fan_roots = marks = NULL;
+  flush_handle_cache();
+
+  if (fanotify_fd >= 0) {
+    close(fanotify_fd);
+    fanotify_fd = -1;
+  }
+}
+
+#else
+
+bool init_fanotify() {
+  userlog(LOG_INFO, "fanotify: not supported by this build");
+  return false;
+}
+
+void set_fanotify_callback(void (* callback)(const char*, int)) { (void)callback; }
+int get_fanotify_fd() { return -1; }
+int fanotify_watch(const char* path, array* mounts) { (void)path; (void)mounts; return ERR_UNSUPPORTED; }
+void fanotify_unwatch(int id) { (void)id; }
+bool process_fanotify_input() { return true; }
+void close_fanotify() { }
+
+#endif
@@ -19,7 +19,9 @@
 #define VERSION "20160218.1348"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 
 // messaging
@@ -48,34 +50,245 @@ void* array_get(array* a, int index);
 void array_delete(array* a);
 void array_delete_vs_data(array* a);
 void array_delete_data(array* a);
+void array_sort(array* a, int (* compare)(const void*, const void*));
+void* array_bsearch(array* a, const void* key, int (* compare)(const void*, const void*));
 
 
-// poor man's hash table
+// hash table with int keys
 typedef struct __table table;
 
 table* table_create(int capacity);
 void* table_put(table* t, int key, void* value);
 void* table_get(table* t, int key);
+int table_size(table* t);
+size_t table_memory(table* t);
 void table_delete(table* t);
 
 
+// string interning
+#define NO_STRING UINT32_MAX
+
+uint32_t intern_string(const char* s, int len);
+uint32_t intern_find(const char* s, int len);
+void intern_release(uint32_t id);
+const char* intern_get(uint32_t id);
+int intern_length(uint32_t id);
+size_t intern_memory();
+void intern_cleanup();
+
+
+// work-stealing thread pool; the thread calling pool_run() acts as one of the workers
+typedef struct __pool pool;
+
+pool* pool_create(int threads);
+int pool_size(pool* p);
+bool pool_run(pool* p, void (* process)(void*), void* item);
+bool pool_submit(pool* p, void* item);
+void pool_delete(pool* p);
+
+
+// mount table (cached mountinfo, re-read after the kernel reports a change on the descriptor)
+void init_mount_table();
+int get_mount_table_fd();
+void mount_table_changed();
+const char* unwatchable_parent_mount(const char* path);
+bool collect_mounts(const char* path, bool watchable, array* result);
+void close_mount_table();
+
+
+// directory exclusion patterns (globs); `new_patterns` is consumed
+bool set_exclude_patterns(array* new_patterns, bool* changed);
+bool is_excluded_dir(const char* parent, int parent_len, const char* name);
+bool has_path_patterns();
+void clear_exclude_patterns();
+
+
+// watch budget: client-assigned priorities (`lines` are consumed) and directories left without a watch
+bool set_priorities(array* lines, bool* changed);
+int path_priority(const char* path);
+int watch_budget(int own_watches);
+bool uncovered_add(const char* path);
+void uncovered_move(const char* from, const char* to);
+void uncovered_remove_under(const char* root);
+int uncovered_count();
+const char* uncovered_get(int i);
+bool take_uncovered_changes();
+void uncovered_clear();
+void poll_uncovered();
+void drop_gone_uncovered();
+void close_budget();
+
+
 // inotify subsystem
+#define WALK_THREADS_ENV "FSNOTIFIER_WALK_THREADS"
+
 enum {
   ERR_IGNORE = -1,
   ERR_CONTINUE = -2,
   ERR_ABORT = -3,
-  ERR_MISSING = -4
+  ERR_MISSING = -4,
+  ERR_UNSUPPORTED = -5,
+  ERR_LIMIT = -6
 };
 
+// counters for the STATS command; paired rename halves and repeated overflow markers count as coalesced
+typedef struct {
+  uint64_t events_read;
+  uint64_t events_coalesced;
+  uint64_t limit_hits;  // ENOSPC from inotify_add_watch()
+} inotify_stats;
+
+// Kernel and disk access of the inotify subsystem. Directory handles are opaque; walks only need names of
+// subdirectories, and a descriptor (or -1) for snapshots. Calls fail with -1 (NULL) and errno, as the system calls do.
+struct stat;
+
+typedef struct {
+  const char* name;
+  int (* init)();  // returns a descriptor to wait on for events
+  int (* watch_limit)();
+  int (* add_watch)(const char* path, uint32_t mask);
+  int (* rm_watch)(int wd);
+  ssize_t (* read_events)(char* buf, size_t len);
+  void (* close)();
+  int (* stat)(const char* path, struct stat* st);
+  void* (* open_dir)(const char* path);
+  const char* (* next_subdir)(void* dir, bool* unknown);  // `unknown` entries may not be directories
+  bool (* stat_subdir)(void* dir, const char* name);  // checks an `unknown` entry
+  bool (* has_subdir)(void* dir, const char* name);
+  int (* dir_fd)(void* dir);
+  void (* close_dir)(void* dir);
+} watch_backend;
+
+extern const watch_backend kernel_backend;
+
+void set_watch_backend(const watch_backend* backend);
 bool init_inotify();
 void set_inotify_callback(void (* callback)(const char*, int));
+void set_move_callback(void (* callback)(const char* from, const char* to, bool is_dir));
 int get_inotify_fd();
 int watch(const char* root, array* mounts);
 void unwatch(int id);
+int get_watch_limit();
+int get_watch_usage();
+size_t get_watch_memory();
+void get_inotify_stats(inotify_stats* stats);
+int get_watch_path(int wd, char* buf, int buf_size);
+int get_watch_id(int root_id, const char* path);
+bool watch_prioritized(array* roots, array* root_mounts, const int* parents, int* ids, int budget);
 bool process_inotify_input();
+bool replay_inotify(const char* name, void (* batch_done)(), uint64_t* events);
 void close_inotify();
 
 
+// simulated kernel and disk: a synthetic tree of `depth` levels with `fanout` subdirectories each, under SIM_ROOT;
+// lets walks run at sizes no disk or watch limit would allow (events are never delivered)
+#define SIM_ROOT "/sim"
+
+extern const watch_backend sim_backend;
+
+void sim_configure(int depth, int fanout);
+uint64_t sim_directory_count();
+
+
+// recording of the inotify subsystem (events read, watch tree changes), to be replayed by `replay_inotify()`
+#define RECORD_ENV "FSNOTIFIER_RECORD"
+
+typedef enum {
+  RECORD_EVENT, RECORD_READ_END, RECORD_WATCH, RECORD_UNWATCH
+} record_type;
+
+bool init_recording();
+void record_append(record_type type, int wd, int parent, const void* payload, uint32_t len);
+void close_recording();
+bool replay_open(const char* name);
+bool replay_next(record_type* type, int* wd, int* parent, const char** payload, uint32_t* len);
+void replay_close();
+
+extern const watch_backend replay_backend;
+
+
+// directory snapshots: listings of watched directories, compared to the disk when a directory is walked again
+#define SNAPSHOT_ENV "FSNOTIFIER_SNAPSHOTS"
+#define SNAPSHOT_FILE_ENV "FSNOTIFIER_SNAPSHOT_FILE"
+
+bool init_snapshots();
+void snapshot_dir(int wd, int dir_fd, const char* path);
+void snapshot_update(int wd, const char* path, const char* name, bool created, bool removed);
+void snapshot_drop(int wd);
+void snapshot_report(void (* report)(const char* event, const char* path));
+bool snapshot_has_saved();
+bool snapshot_saved(const char* path);
+void snapshot_release_saved();
+void snapshot_save();
+void close_snapshots();
+
+
+// sentinels: missing paths are awaited by watching their nearest existing ancestors
+bool init_sentinels();
+void set_sentinel_callback(void (* callback)(const char*, bool));
+int get_sentinel_fd();
+bool sentinel_watch(const char* path);
+void sentinel_unwatch(const char* path);
+bool process_sentinel_input();
+void close_sentinels();
+
+
+// polling of mounts which cannot be watched; events are delivered on the calling thread by process_poll_input()
+#define POLL_THREADS_ENV "FSNOTIFIER_POLL_THREADS"
+
+bool init_polling();
+void set_poll_callback(void (* callback)(const char*, int));
+int get_poll_fd();
+int poll_watch(const char* root);
+int poll_watch_uncovered(const char* dir);
+void poll_unwatch(int id);
+void poll_reset();
+bool process_poll_input();
+void close_polling();
+
+
+// fanotify subsystem (filesystem-wide marks, events filtered by roots)
+bool init_fanotify();
+void set_fanotify_callback(void (* callback)(const char*, int));
+int get_fanotify_fd();
+int fanotify_watch(const char* root, array* mounts);
+void fanotify_unwatch(int id);
+bool process_fanotify_input();
+void close_fanotify();
+
+
+// latency tracing: USDT probes at entry and exit of each stage (when built with <sys/sdt.h>),
+// and per-stage histograms, kept only when enabled by the environment variable
+#define TRACE_ENV "FSNOTIFIER_TRACE"
+
+typedef enum {
+  TRACE_READ, TRACE_EVENT, TRACE_CALLBACK, TRACE_WRITE, TRACE_STAGES
+} trace_stage;
+
+extern bool trace_enabled;
+
+bool init_tracing();
+uint64_t trace_clock();
+void trace_record(trace_stage stage, uint64_t start);
+const char* trace_stage_name(trace_stage stage);
+uint64_t trace_summary(trace_stage stage, const double* quantiles, uint64_t* values, int count);
+void close_tracing();
+
+#define TRACE_START() (trace_enabled ? trace_clock() : 0)
+#define TRACE_END(stage, start) do { if (trace_enabled) trace_record(stage, start); } while (0)
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define PROBE(name) DTRACE_PROBE(fsnotifier, name)
+#define PROBE1(name, a) DTRACE_PROBE1(fsnotifier, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(fsnotifier, name, a, b)
+#else
+#define PROBE(name) do {} while (0)
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#endif
+
+
 // reads one line from stream, trims trailing carriage return if any
 // returns pointer to the internal buffer (will be overwritten on next call)
 char* read_line(FILE* stream);
@@ -18,7 +18,11 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,56 +40,141 @@ __asm__(".symver memcpy,memcpy@GLIBC_2.2.5");
 
 #define WATCH_COUNT_NAME "/proc/sys/fs/inotify/max_user_watches"
 
-#define DEFAULT_SUBDIR_COUNT 5
+#define INITIAL_WATCH_TABLE_SIZE 1024
 
-typedef struct __watch_node {
+#define DEFAULT_WALK_THREADS 8
+#define MAX_WALK_THREADS 64
+
+// Nodes live in aligned slab chunks and refer to each other by 32-bit indices;
+// children of a node form a doubly-linked list threaded through the siblings.
+// A node keeps only its own name, full paths are assembled from the parent chain on demand.
+#define NODE_CHUNK_SIZE (64 * 1024)
+#define NO_NODE UINT32_MAX
+
+typedef struct {
   int wd;
-  struct __watch_node* parent;
-  array* kids;
-  int path_len;
-  char path[];
+  uint32_t parent;
+  uint32_t first_kid;
+  uint32_t next_sibling;  // links the free list in unused nodes
+  uint32_t prev_sibling;
+  uint32_t name;  // interned last path component; full path for roots
 } watch_node;
 
+typedef struct {
+  uint32_t base;  // index of nodes[0]
+  watch_node nodes[];
+} node_chunk;
+
+#define NODES_PER_CHUNK ((uint32_t)((NODE_CHUNK_SIZE - sizeof(node_chunk)) / sizeof(watch_node)))
+
+static node_chunk** chunks = NULL;
+static uint32_t chunk_count = 0;
+static uint32_t chunk_capacity = 0;
+static uint32_t next_fresh_node = 0;
+static uint32_t free_nodes = NO_NODE;
+static uint32_t live_nodes = 0;
+
+// Set of linked nodes hashed by (parent, name): O(1) lookup of a child by name.
+// Slots hold node indices, keys are read from the nodes themselves.
+#define KID_INDEX_MIN_CAPACITY 1024
+
+static uint32_t* kid_index = NULL;
+static uint32_t kid_index_capacity = 0;
+static uint32_t kid_index_size = 0;
+
+static const watch_backend* backend = &kernel_backend;
 static int inotify_fd = -1;
 static int watch_count = 0;
 static table* watches;
 static bool limit_reached = false;
 static void (* callback)(const char*, int) = NULL;
+static void (* move_callback)(const char*, const char*, bool) = NULL;
+static inotify_stats stats = {0, 0, 0};
+static bool replaying = false;  // directories are not read, watches come from the recording
+
+// the first half of a rename, held until the next event tells whether the other half is in a watched tree
+// (the kernel queues both halves of a rename next to each other)
+static struct {
+  char* path;
+  uint32_t cookie;
+  uint32_t mask;
+  int wd;  // the watch of a moved directory, or -1
+} pending_move = {NULL, 0, 0, -1};
 
 #define EVENT_SIZE (sizeof(struct inotify_event))
 #define EVENT_BUF_LEN (2048 * (EVENT_SIZE + 16))
-static char event_buf[EVENT_BUF_LEN];
+#define MAX_EVENT_BUF_LEN (32 * EVENT_BUF_LEN)
+static char* event_buf = NULL;
+static size_t event_buf_len = 0;
 
 static char path_buf[2 * PATH_MAX];
 
-static void read_watch_descriptors_count();
+static pool* walk_pool = NULL;
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// excluded mount points below a root, by path component; the walk carries a cursor into it
+// and only looks names up while it stays on a path leading to some mount
+typedef struct mount_trie {
+  struct mount_trie* kids;
+  struct mount_trie* next;
+  bool excluded;
+  char name[];
+} mount_trie;
+
+typedef struct {
+  watch_node* parent;
+  mount_trie* mounts;
+  int path_len;
+  char path[];
+} walk_item;
+
+// state of the parallel walk in progress
+static atomic_int walk_status;
+static int walk_root_id;
+
+static void free_node_chunks();
+static void init_walk_pool();
+static int register_watch(int wd, const char* path, int path_len, watch_node* parent);
+static void rm_watch(int wd);
+static void prune_kids(watch_node* node, void* dir, const char* path, int path_len);
 static void watch_limit_reached();
 
 
+// must be called before init_inotify()
+void set_watch_backend(const watch_backend* _backend) {
+  backend = _backend;
+}
+
 bool init_inotify() {
-  inotify_fd = inotify_init();
+  inotify_fd = backend->init();
   if (inotify_fd < 0) {
-    int e = errno;
-    userlog(LOG_ERR, "inotify_init: %s", strerror(e));
-    if (e == EMFILE) {
-      message(MSG_INSTANCE_LIMIT);
-    }
     return false;
   }
-  userlog(LOG_DEBUG, "inotify fd: %d", get_inotify_fd());
+  userlog(LOG_DEBUG, "%s fd: %d", backend->name, get_inotify_fd());
 
-  read_watch_descriptors_count();
+  watch_count = backend->watch_limit();
   if (watch_count <= 0) {
-    close(inotify_fd);
+    backend->close();
     inotify_fd = -1;
     return false;
   }
   userlog(LOG_INFO, "inotify watch descriptors: %d", watch_count);
 
-  watches = table_create(watch_count);
+  event_buf = malloc(EVENT_BUF_LEN);
+  if (event_buf == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    backend->close();
+    inotify_fd = -1;
+    return false;
+  }
+  event_buf_len = EVENT_BUF_LEN;
+
+  init_walk_pool();
+
+  watches = table_create(INITIAL_WATCH_TABLE_SIZE);
   if (watches == NULL) {
     userlog(LOG_ERR, "out of memory");
-    close(inotify_fd);
+    backend->close();
     inotify_fd = -1;
     return false;
   }
@@ -93,22 +182,128 @@ bool init_inotify() {
   return true;
 }
 
-static void read_watch_descriptors_count() {
+
+// The kernel backend: inotify(7) and the real disk.
+static int kernel_fd = -1;
+
+static int kernel_init() {
+  kernel_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (kernel_fd < 0) {
+    int e = errno;
+    userlog(LOG_ERR, "inotify_init1: %s", strerror(e));
+    if (e == EMFILE) {
+      message(MSG_INSTANCE_LIMIT);
+    }
+  }
+  return kernel_fd;
+}
+
+static int kernel_watch_limit() {
   FILE* f = fopen(WATCH_COUNT_NAME, "r");
   if (f == NULL) {
     userlog(LOG_ERR, "can't open %s: %s", WATCH_COUNT_NAME, strerror(errno));
-    return;
+    return 0;
   }
 
+  int count = 0;
   char* str = read_line(f);
   if (str == NULL) {
     userlog(LOG_ERR, "can't read from %s", WATCH_COUNT_NAME);
   }
   else {
-    watch_count = atoi(str);
+    count = atoi(str);
   }
 
   fclose(f);
+  return count;
+}
+
+static int kernel_add_watch(const char* path, uint32_t mask) {
+  return inotify_add_watch(kernel_fd, path, mask);
+}
+
+static int kernel_rm_watch(int wd) {
+  return inotify_rm_watch(kernel_fd, wd);
+}
+
+static ssize_t kernel_read_events(char* buf, size_t len) {
+  return read(kernel_fd, buf, len);
+}
+
+static void kernel_close() {
+  if (kernel_fd >= 0) {
+    close(kernel_fd);
+    kernel_fd = -1;
+  }
+}
+
+static void* kernel_open_dir(const char* path) {
+  return opendir(path);
+}
+
+// entries of unknown type (file systems without d_type) are left to the caller to check with stat_subdir(),
+// which it only does for those not excluded by name or mount point
+static const char* kernel_next_subdir(void* dir, bool* unknown) {
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    if (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN) {
+      *unknown = (entry->d_type == DT_UNKNOWN);
+      return entry->d_name;
+    }
+  }
+  return NULL;
+}
+
+// follows symlinks, as opendir() would
+static bool kernel_stat_subdir(void* dir, const char* name) {
+  struct stat st;
+  if (fstatat(dirfd(dir), name, &st, 0) != 0) {
+    userlog(LOG_DEBUG, "(DT_UNKNOWN) stat(%s): %d", name, errno);
+    return false;
+  }
+  return S_ISDIR(st.st_mode);
+}
+
+static bool kernel_has_subdir(void* dir, const char* name) {
+  struct stat st;
+  return fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int kernel_dir_fd(void* dir) {
+  return dirfd(dir);
+}
+
+static void kernel_close_dir(void* dir) {
+  closedir(dir);
+}
+
+const watch_backend kernel_backend = {
+  "inotify", &kernel_init, &kernel_watch_limit, &kernel_add_watch, &kernel_rm_watch, &kernel_read_events, &kernel_close,
+  &stat, &kernel_open_dir, &kernel_next_subdir, &kernel_stat_subdir, &kernel_has_subdir, &kernel_dir_fd, &kernel_close_dir
+};
+
+
+static void init_walk_pool() {
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > DEFAULT_WALK_THREADS) {
+    threads = DEFAULT_WALK_THREADS;
+  }
+
+  char* env_threads = getenv(WALK_THREADS_ENV);
+  if (env_threads != NULL) {
+    threads = atoi(env_threads);
+    if (threads > MAX_WALK_THREADS) {
+      threads = MAX_WALK_THREADS;
+    }
+  }
+
+  if (threads > 1) {
+    walk_pool = pool_create(threads);
+  }
+  userlog(LOG_INFO, "tree walk threads: %d", walk_pool != NULL ? pool_size(walk_pool) : 1);
 }
 
 
@@ -117,50 +312,274 @@ void set_inotify_callback(void (* _callback)(const char*, int)) {
 }
 
 
+void set_move_callback(void (* _callback)(const char*, const char*, bool)) {
+  move_callback = _callback;
+}
+
 int get_inotify_fd() {
   return inotify_fd;
 }
 
 
+static inline watch_node* node_at(uint32_t index) {
+  return &chunks[index / NODES_PER_CHUNK]->nodes[index % NODES_PER_CHUNK];
+}
+
+static inline uint32_t index_of(watch_node* node) {
+  node_chunk* chunk = (node_chunk*)((uintptr_t)node & ~(uintptr_t)(NODE_CHUNK_SIZE - 1));
+  return chunk->base + (uint32_t)(node - chunk->nodes);
+}
+
+static uint32_t alloc_node() {
+  uint32_t index = free_nodes;
+  if (index != NO_NODE) {
+    free_nodes = node_at(index)->next_sibling;
+  }
+  else {
+    if (next_fresh_node == chunk_count * NODES_PER_CHUNK) {
+      if (chunk_count == chunk_capacity) {
+        uint32_t new_cap = (chunk_capacity > 0 ? chunk_capacity * 2 : 16);
+        node_chunk** new_chunks = realloc(chunks, sizeof(node_chunk*) * new_cap);
+        CHECK_NULL(new_chunks, NO_NODE);
+        chunks = new_chunks;
+        chunk_capacity = new_cap;
+      }
+      node_chunk* chunk = aligned_alloc(NODE_CHUNK_SIZE, NODE_CHUNK_SIZE);
+      CHECK_NULL(chunk, NO_NODE);
+      chunk->base = chunk_count * NODES_PER_CHUNK;
+      chunks[chunk_count++] = chunk;
+    }
+    index = next_fresh_node++;
+  }
+
+  watch_node* node = node_at(index);
+  node->parent = node->first_kid = node->next_sibling = node->prev_sibling = NO_NODE;
+  live_nodes++;
+  return index;
+}
+
+static void release_node(uint32_t index) {
+  watch_node* node = node_at(index);
+  intern_release(node->name);
+  node->name = NO_STRING;
+  node->next_sibling = free_nodes;
+  free_nodes = index;
+
+  if (--live_nodes == 0) {
+    free_node_chunks();
+  }
+}
+
+static void free_node_chunks() {
+  for (uint32_t i=0; i<chunk_count; i++) {
+    free(chunks[i]);
+  }
+  free(chunks);
+  chunks = NULL;
+  chunk_count = chunk_capacity = next_fresh_node = live_nodes = 0;
+  free_nodes = NO_NODE;
+
+  free(kid_index);
+  kid_index = NULL;
+  kid_index_capacity = kid_index_size = 0;
+}
+
+// writes the full path of the node into `buf`; returns its length or -1 if it doesn't fit
+static int node_path(watch_node* node, char* buf, int buf_size) {
+  int len = intern_length(node->name);
+  for (watch_node* n = node; n->parent != NO_NODE; ) {
+    n = node_at(n->parent);
+    len += intern_length(n->name) + 1;
+  }
+  if (len >= buf_size) {
+    return -1;
+  }
+
+  buf[len] = '\0';
+  int pos = len;
+  for (watch_node* n = node; ; n = node_at(n->parent)) {
+    int name_len = intern_length(n->name);
+    pos -= name_len;
+    memcpy(buf + pos, intern_get(n->name), name_len);
+    if (n->parent == NO_NODE) {
+      break;
+    }
+    buf[--pos] = '/';
+  }
+
+  return len;
+}
+
+static inline uint32_t kid_slot(uint32_t parent, uint32_t name) {
+  uint64_t key = ((uint64_t)parent << 32 | name) * 0x9E3779B97F4A7C15ull;
+  return (uint32_t)(key >> 32) & (kid_index_capacity - 1);
+}
+
+static bool kid_index_resize(uint32_t new_capacity) {
+  uint32_t* old_index = kid_index;
+  uint32_t old_capacity = kid_index_capacity;
+
+  kid_index = malloc(sizeof(uint32_t) * new_capacity);
+  if (kid_index == NULL) {
+    kid_index = old_index;
+    return false;
+  }
+  memset(kid_index, 0xFF, sizeof(uint32_t) * new_capacity);
+  kid_index_capacity = new_capacity;
+
+  for (uint32_t i=0; i<old_capacity; i++) {
+    if (old_index[i] != NO_NODE) {
+      watch_node* node = node_at(old_index[i]);
+      uint32_t k = kid_slot(node->parent, node->name);
+      while (kid_index[k] != NO_NODE) {
+        k = (k + 1) & (kid_index_capacity - 1);
+      }
+      kid_index[k] = old_index[i];
+    }
+  }
+
+  free(old_index);
+  return true;
+}
+
+static bool kid_index_add(uint32_t index) {
+  if ((kid_index_size + 1) * 2 > kid_index_capacity &&
+      !kid_index_resize(kid_index_capacity > 0 ? kid_index_capacity * 2 : KID_INDEX_MIN_CAPACITY)) {
+    return false;
+  }
+
+  watch_node* node = node_at(index);
+  uint32_t k = kid_slot(node->parent, node->name);
+  while (kid_index[k] != NO_NODE) {
+    k = (k + 1) & (kid_index_capacity - 1);
+  }
+  kid_index[k] = index;
+  kid_index_size++;
+  return true;
+}
+
+static void kid_index_remove(uint32_t index) {
+  watch_node* node = node_at(index);
+  uint32_t mask = kid_index_capacity - 1;
+  uint32_t i = kid_slot(node->parent, node->name);
+  while (kid_index[i] != index) {
+    if (kid_index[i] == NO_NODE) {
+      return;
+    }
+    i = (i + 1) & mask;
+  }
+
+  for (uint32_t j = (i + 1) & mask; kid_index[j] != NO_NODE; j = (j + 1) & mask) {
+    watch_node* other = node_at(kid_index[j]);
+    uint32_t k = kid_slot(other->parent, other->name);
+    bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+    if (!stays) {
+      kid_index[i] = kid_index[j];
+      i = j;
+    }
+  }
+  kid_index[i] = NO_NODE;
+  kid_index_size--;
+
+  if (kid_index_capacity > KID_INDEX_MIN_CAPACITY && kid_index_size < kid_index_capacity / 8) {
+    kid_index_resize(kid_index_capacity / 2);
+  }
+}
+
+static uint32_t find_kid(uint32_t parent, uint32_t name) {
+  if (kid_index_size == 0) {
+    return NO_NODE;
+  }
+  for (uint32_t k = kid_slot(parent, name); kid_index[k] != NO_NODE; k = (k + 1) & (kid_index_capacity - 1)) {
+    watch_node* node = node_at(kid_index[k]);
+    if (node->parent == parent && node->name == name) {
+      return kid_index[k];
+    }
+  }
+  return NO_NODE;
+}
+
+static bool link_node(uint32_t index, uint32_t parent) {
+  watch_node* node = node_at(index);
+  watch_node* parent_node = node_at(parent);
+  node->parent = parent;
+  node->prev_sibling = NO_NODE;
+  node->next_sibling = parent_node->first_kid;
+  if (parent_node->first_kid != NO_NODE) {
+    node_at(parent_node->first_kid)->prev_sibling = index;
+  }
+  parent_node->first_kid = index;
+  return kid_index_add(index);
+}
+
+static void unlink_node(uint32_t index) {
+  watch_node* node = node_at(index);
+  if (node->parent == NO_NODE) {
+    return;
+  }
+  kid_index_remove(index);
+  if (node->prev_sibling != NO_NODE) {
+    node_at(node->prev_sibling)->next_sibling = node->next_sibling;
+  }
+  else {
+    node_at(node->parent)->first_kid = node->next_sibling;
+  }
+  if (node->next_sibling != NO_NODE) {
+    node_at(node->next_sibling)->prev_sibling = node->prev_sibling;
+  }
+  node->parent = node->next_sibling = node->prev_sibling = NO_NODE;
+}
+
+
 #define EVENT_MASK IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVE | IN_DELETE_SELF | IN_MOVE_SELF
 
-static int add_watch(int path_len, watch_node* parent) {
-  int wd = inotify_add_watch(inotify_fd, path_buf, EVENT_MASK);
+static int add_watch(const char* path, int path_len, watch_node* parent) {
+  int wd = backend->add_watch(path, EVENT_MASK);
+  pthread_mutex_lock(&tree_lock);
+  int result = register_watch(wd, path, path_len, parent);
+  pthread_mutex_unlock(&tree_lock);
+  return result;
+}
+
+static int register_watch(int wd, const char* path, int path_len, watch_node* parent) {
   if (wd < 0) {
     if (errno == EACCES || errno == ENOENT) {
-      userlog(LOG_DEBUG, "inotify_add_watch(%s): %s", path_buf, strerror(errno));
+      userlog(LOG_DEBUG, "inotify_add_watch(%s): %s", path, strerror(errno));
       return ERR_IGNORE;
     }
     else if (errno == ENOSPC) {
-      userlog(LOG_WARNING, "inotify_add_watch(%s): %s", path_buf, strerror(errno));
+      stats.limit_hits++;
+      userlog(LOG_WARNING, "inotify_add_watch(%s): %s", path, strerror(errno));
       watch_limit_reached();
-      return ERR_CONTINUE;
+      return ERR_LIMIT;
     }
     else {
-      userlog(LOG_ERR, "inotify_add_watch(%s): %s", path_buf, strerror(errno));
+      userlog(LOG_ERR, "inotify_add_watch(%s): %s", path, strerror(errno));
       return ERR_ABORT;
     }
   }
   else {
-    userlog(LOG_DEBUG, "watching %s: %d", path_buf, wd);
+    userlog(LOG_DEBUG, "watching %s: %d", path, wd);
   }
 
   watch_node* node = table_get(watches, wd);
   if (node != NULL) {
+    char node_path_buf[PATH_MAX];
+    const char* existing = (node_path(node, node_path_buf, PATH_MAX) >= 0 ? node_path_buf : "?");
     if (node->wd != wd) {
-      userlog(LOG_ERR, "table error: corruption at %d:%s / %d:%s)", wd, path_buf, node->wd, node->path);
+      userlog(LOG_ERR, "table error: corruption at %d:%s / %d:%s)", wd, path, node->wd, existing);
       return ERR_ABORT;
     }
-    else if (strcmp(node->path, path_buf) != 0) {
+    else if (strcmp(existing, path) != 0) {
       char buf1[PATH_MAX], buf2[PATH_MAX];
-      const char* normalized1 = realpath(node->path, buf1);
-      const char* normalized2 = realpath(path_buf, buf2);
+      const char* normalized1 = realpath(existing, buf1);
+      const char* normalized2 = realpath(path, buf2);
       if (normalized1 == NULL || normalized2 == NULL || strcmp(normalized1, normalized2) != 0) {
-        userlog(LOG_ERR, "table error: collision at %d (new %s, existing %s)", wd, path_buf, node->path);
+        userlog(LOG_ERR, "table error: collision at %d (new %s, existing %s)", wd, path, existing);
         return ERR_ABORT;
       }
       else {
-        userlog(LOG_INFO, "intersection at %d: (new %s, existing %s, real %s)", wd, path_buf, node->path, normalized1);
+        userlog(LOG_INFO, "intersection at %d: (new %s, existing %s, real %s)", wd, path, existing, normalized1);
         return ERR_IGNORE;
       }
     }
@@ -168,27 +587,45 @@ static int add_watch(int path_len, watch_node* parent) {
     return wd;
   }
 
-  node = malloc(sizeof(watch_node) + path_len + 1);
-  CHECK_NULL(node, ERR_ABORT);
-  memcpy(node->path, path_buf, path_len + 1);
-  node->path_len = path_len;
-  node->wd = wd;
-  node->parent = parent;
-  node->kids = NULL;
-
+  const char* name = path;
   if (parent != NULL) {
-    if (parent->kids == NULL) {
-      parent->kids = array_create(DEFAULT_SUBDIR_COUNT);
-      CHECK_NULL(parent->kids, ERR_ABORT);
+    const char* slash = strrchr(path, '/');
+    name = (slash != NULL ? slash + 1 : path);
+  }
+  uint32_t name_id = intern_string(name, path_len - (name - path));
+  if (name_id == NO_STRING) {
+    userlog(LOG_ERR, "out of memory");
+    return ERR_ABORT;
+  }
+  if (parent != NULL) {
+    // same name but another watch - the directory was replaced while its events were lost
+    uint32_t stale = find_kid(index_of(parent), name_id);
+    if (stale != NO_NODE) {
+      userlog(LOG_DEBUG, "replacing stale watch %d: %s", node_at(stale)->wd, path);
+      rm_watch(node_at(stale)->wd);
     }
-    CHECK_NULL(array_push(parent->kids, node), ERR_ABORT);
+  }
+
+  uint32_t index = alloc_node();
+  if (index == NO_NODE) {
+    intern_release(name_id);
+    return ERR_ABORT;
+  }
+
+  node = node_at(index);
+  node->name = name_id;
+  node->wd = wd;
+  if (parent != NULL && !link_node(index, index_of(parent))) {
+    userlog(LOG_ERR, "out of memory");
+    return ERR_ABORT;
   }
 
   if (table_put(watches, wd, node) == NULL) {
-    userlog(LOG_ERR, "table error: unable to put (%d:%s)", wd, path_buf);
+    userlog(LOG_ERR, "table error: unable to put (%d:%s)", wd, path);
     return ERR_ABORT;
   }
 
+  record_append(RECORD_WATCH, wd, parent != NULL ? parent->wd : -1, path, path_len);
   return wd;
 }
 
@@ -199,52 +636,157 @@ static void watch_limit_reached() {
   }
 }
 
-static void rm_watch(int wd, bool update_parent) {
+// removes the watch along with the whole subtree below it, returning the nodes to the free list
+static void rm_watch(int wd) {
   watch_node* node = table_get(watches, wd);
   if (node == NULL) {
     return;
   }
+  record_append(RECORD_UNWATCH, wd, -1, NULL, 0);
 
-  userlog(LOG_DEBUG, "unwatching %s: %d (%p)", node->path, node->wd, node);
+  uint32_t top = index_of(node);
+  unlink_node(top);
 
-  if (inotify_rm_watch(inotify_fd, node->wd) < 0) {
-    userlog(LOG_DEBUG, "inotify_rm_watch(%d:%s): %s", node->wd, node->path, strerror(errno));
-  }
+  uint32_t index = top;
+  while (true) {
+    node = node_at(index);
+    if (node->first_kid != NO_NODE) {
+      index = node->first_kid;
+      continue;
+    }
+
+    userlog(LOG_DEBUG, "unwatching %s: %d (%u)", intern_get(node->name), node->wd, index);
+    if (backend->rm_watch(node->wd) < 0) {
+      userlog(LOG_DEBUG, "inotify_rm_watch(%d:%s): %s", node->wd, intern_get(node->name), strerror(errno));
+    }
+    table_put(watches, node->wd, NULL);
+    snapshot_drop(node->wd);
 
-  for (int i=0; i<array_size(node->kids); i++) {
-    watch_node* kid = array_get(node->kids, i);
-    if (kid != NULL) {
-      rm_watch(kid->wd, false);
+    uint32_t parent = node->parent, next = node->next_sibling;
+    if (parent != NO_NODE) {
+      kid_index_remove(index);
     }
+    release_node(index);
+    if (index == top) {
+      break;
+    }
+
+    // kids are always released from the head of the list
+    node_at(parent)->first_kid = next;
+    index = (next != NO_NODE ? next : parent);
   }
+}
 
-  if (update_parent && node->parent != NULL) {
-    for (int i=0; i<array_size(node->parent->kids); i++) {
-      if (array_get(node->parent->kids, i) == node) {
-        array_put(node->parent->kids, i, NULL);
-        break;
-      }
+
+// drops subtrees of directories which disappeared while events were lost (on rescans of existing nodes)
+static void prune_kids(watch_node* node, void* dir, const char* path, int path_len) {
+  uint32_t i = node->first_kid;
+  while (i != NO_NODE) {
+    watch_node* kid = node_at(i);
+    i = kid->next_sibling;
+
+    const char* name = intern_get(kid->name);
+    if (!backend->has_subdir(dir, name)) {
+      userlog(LOG_DEBUG, "dropping stale watch %d: %s", kid->wd, name);
+      rm_watch(kid->wd);
+    }
+    else if (is_excluded_dir(path, path_len, name)) {
+      userlog(LOG_DEBUG, "dropping excluded watch %d: %s", kid->wd, name);
+      rm_watch(kid->wd);
     }
   }
+}
+
 
-  array_delete(node->kids);
-  free(node);
-  table_put(watches, wd, NULL);
+static mount_trie* new_trie_node(const char* name, int name_len) {
+  mount_trie* node = calloc(1, sizeof(mount_trie) + name_len + 1);
+  CHECK_NULL(node, NULL);
+  memcpy(node->name, name, name_len);
+  node->name[name_len] = '\0';
+  return node;
 }
 
+static void delete_mount_trie(mount_trie* node) {
+  while (node != NULL) {
+    mount_trie* next = node->next;
+    delete_mount_trie(node->kids);
+    free(node);
+    node = next;
+  }
+}
 
-static int walk_tree(int path_len, watch_node* parent, bool recursive, array* mounts) {
-  for (int j=0; j<array_size(mounts); j++) {
-    char* mount = array_get(mounts, j);
-    if (strncmp(path_buf, mount, strlen(mount)) == 0) {
-      userlog(LOG_DEBUG, "watch path '%s' crossed mount point '%s' - skipping", path_buf, mount);
+static mount_trie* trie_kid(mount_trie* node, const char* name, int name_len) {
+  for (mount_trie* kid = node->kids; kid != NULL; kid = kid->next) {
+    if (strncmp(kid->name, name, name_len) == 0 && kid->name[name_len] == '\0') {
+      return kid;
+    }
+  }
+  return NULL;
+}
+
+// compiles mount points under the root (`path_len` bytes of `root`) into a trie, which stays NULL when there are none;
+// returns ERR_IGNORE when the root itself lies on an excluded mount
+static int build_mount_trie(const char* root, int path_len, array* mounts, mount_trie** trie) {
+  *trie = NULL;
+
+  for (int i=0; i<array_size(mounts); i++) {
+    const char* mount = array_get(mounts, i);
+    int mount_len = strlen(mount);
+    if (strncmp(mount, root, mount_len) == 0 && (mount_len == path_len || root[mount_len] == '/')) {
+      userlog(LOG_DEBUG, "watch path '%.*s' is under mount point '%s' - skipping", path_len, root, mount);
+      delete_mount_trie(*trie);
+      *trie = NULL;
       return ERR_IGNORE;
     }
+    if (mount_len <= path_len || strncmp(mount, root, path_len) != 0 || mount[path_len] != '/') {
+      continue;
+    }
+
+    if (*trie == NULL && (*trie = new_trie_node("", 0)) == NULL) {
+      return ERR_ABORT;
+    }
+    mount_trie* node = *trie;
+    const char* p = mount + path_len + 1;
+    while (*p != '\0') {
+      const char* end = strchr(p, '/');
+      int name_len = (end != NULL ? end - p : (int)strlen(p));
+      mount_trie* kid = trie_kid(node, p, name_len);
+      if (kid == NULL) {
+        if ((kid = new_trie_node(p, name_len)) == NULL) {
+          delete_mount_trie(*trie);
+          *trie = NULL;
+          return ERR_ABORT;
+        }
+        kid->next = node->kids;
+        node->kids = kid;
+      }
+      node = kid;
+      p += name_len + (end != NULL ? 1 : 0);
+    }
+    node->excluded = true;
+  }
+
+  return 0;
+}
+
+// the cursor for a subdirectory; sets `excluded` when the subdirectory is an excluded mount point itself
+static mount_trie* descend_mounts(mount_trie* mounts, const char* name, const char* path, bool* excluded) {
+  mount_trie* kid = (mounts != NULL ? trie_kid(mounts, name, strlen(name)) : NULL);
+  *excluded = (kid != NULL && kid->excluded);
+  if (*excluded) {
+    userlog(LOG_DEBUG, "watch path '%s' crossed mount point - skipping", path);
+  }
+  return kid;
+}
+
+static int walk_tree(int path_len, watch_node* parent, bool recursive, mount_trie* mounts) {
+  if (replaying) {
+    return ERR_IGNORE;
   }
 
-  DIR* dir = NULL;
+  void* dir = NULL;
   if (recursive) {
-    if ((dir = opendir(path_buf)) == NULL) {
+    if ((dir = backend->open_dir(path_buf)) == NULL) {
       if (errno == EACCES || errno == ENOENT || errno == ENOTDIR) {
         userlog(LOG_DEBUG, "opendir(%s): %d", path_buf, errno);
         return ERR_IGNORE;
@@ -256,54 +798,172 @@ static int walk_tree(int path_len, watch_node* parent, bool recursive, array* mo
     }
   }
 
-  int id = add_watch(path_len, parent);
+  int id = add_watch(path_buf, path_len, parent);
+  if (id == ERR_LIMIT && parent != NULL) {
+    id = uncovered_add(path_buf) ? ERR_IGNORE : ERR_ABORT;
+  }
 
   if (dir == NULL) {
     return id;
   }
   else if (id < 0) {
-    closedir(dir);
+    backend->close_dir(dir);
     return id;
   }
 
+  watch_node* node = table_get(watches, id);
+  prune_kids(node, dir, path_buf, path_len);
+  snapshot_dir(id, backend->dir_fd(dir), path_buf);
+
   path_buf[path_len] = '/';
 
-  struct dirent* entry;
-  while ((entry = readdir(dir)) != NULL) {
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-      continue;
-    }
-    if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_DIR) {
+  const char* name;
+  bool unknown;
+  while ((name = backend->next_subdir(dir, &unknown)) != NULL) {
+    if (is_excluded_dir(path_buf, path_len, name)) {
       continue;
     }
 
-    int name_len = strlen(entry->d_name);
-    memcpy(path_buf + path_len + 1, entry->d_name, name_len + 1);
+    int name_len = strlen(name);
+    memcpy(path_buf + path_len + 1, name, name_len + 1);
 
-    if (entry->d_type == DT_UNKNOWN) {
-      struct stat st;
-      if (stat(path_buf, &st) != 0) {
-        userlog(LOG_DEBUG, "(DT_UNKNOWN) stat(%s): %d", path_buf, errno);
-        continue;
-      }
-      if (!S_ISDIR(st.st_mode)) {
-        continue;
-      }
+    bool excluded;
+    mount_trie* kid_mounts = descend_mounts(mounts, name, path_buf, &excluded);
+    if (excluded || (unknown && !backend->stat_subdir(dir, name))) {
+      continue;
     }
 
-    int subdir_id = walk_tree(path_len + 1 + name_len, table_get(watches, id), recursive, mounts);
+    int subdir_id = walk_tree(path_len + 1 + name_len, node, recursive, kid_mounts);
     if (subdir_id < 0 && subdir_id != ERR_IGNORE) {
-      rm_watch(id, true);
+      rm_watch(id);
       id = subdir_id;
       break;
     }
   }
 
-  closedir(dir);
+  backend->close_dir(dir);
   return id;
 }
 
 
+static walk_item* new_walk_item(watch_node* parent, mount_trie* mounts, const char* path, int path_len, const char* name) {
+  int name_len = (name != NULL ? strlen(name) + 1 : 0);
+  walk_item* item = malloc(sizeof(walk_item) + path_len + name_len + 1);
+  CHECK_NULL(item, NULL);
+  item->parent = parent;
+  item->mounts = mounts;
+  memcpy(item->path, path, path_len);
+  if (name != NULL) {
+    item->path[path_len] = '/';
+    memcpy(item->path + path_len + 1, name, name_len);
+  }
+  item->path_len = path_len + name_len;
+  item->path[item->path_len] = '\0';
+  return item;
+}
+
+// the parallel counterpart of walk_tree(); subdirectories are handed over to the pool instead of recursion
+static int scan_dir(walk_item* item) {
+  void* dir = backend->open_dir(item->path);
+  if (dir == NULL) {
+    if (errno == EACCES || errno == ENOENT || errno == ENOTDIR) {
+      userlog(LOG_DEBUG, "opendir(%s): %d", item->path, errno);
+      return ERR_IGNORE;
+    }
+    else {
+      userlog(LOG_ERR, "opendir(%s): %s", item->path, strerror(errno));
+      return ERR_CONTINUE;
+    }
+  }
+
+  int id = add_watch(item->path, item->path_len, item->parent);
+  if (id == ERR_LIMIT && item->parent != NULL) {
+    pthread_mutex_lock(&tree_lock);
+    id = uncovered_add(item->path) ? ERR_IGNORE : ERR_ABORT;
+    pthread_mutex_unlock(&tree_lock);
+  }
+  if (id < 0) {
+    backend->close_dir(dir);
+    return id;
+  }
+
+  pthread_mutex_lock(&tree_lock);
+  watch_node* node = table_get(watches, id);
+  prune_kids(node, dir, item->path, item->path_len);
+  pthread_mutex_unlock(&tree_lock);
+  snapshot_dir(id, backend->dir_fd(dir), item->path);
+
+  const char* name;
+  bool unknown;
+  while ((name = backend->next_subdir(dir, &unknown)) != NULL && atomic_load(&walk_status) == 0) {
+    if (is_excluded_dir(item->path, item->path_len, name)) {
+      continue;
+    }
+
+    bool excluded;
+    mount_trie* kid_mounts = descend_mounts(item->mounts, name, item->path, &excluded);
+    if (excluded || (unknown && !backend->stat_subdir(dir, name))) {
+      continue;
+    }
+
+    walk_item* kid = new_walk_item(node, kid_mounts, item->path, item->path_len, name);
+    if (kid == NULL) {
+      id = ERR_ABORT;
+      break;
+    }
+
+    if (!pool_submit(walk_pool, kid)) {
+      userlog(LOG_ERR, "out of memory");
+      free(kid);
+      id = ERR_ABORT;
+      break;
+    }
+  }
+
+  backend->close_dir(dir);
+  return id;
+}
+
+static void process_walk_item(void* p) {
+  walk_item* item = p;
+
+  if (atomic_load(&walk_status) == 0) {
+    int id = scan_dir(item);
+    if (item->parent == NULL) {
+      walk_root_id = id;
+    }
+    if (id < 0 && id != ERR_IGNORE) {
+      int expected = 0;
+      atomic_compare_exchange_strong(&walk_status, &expected, id);
+    }
+  }
+
+  free(item);
+}
+
+static int walk_tree_parallel(const char* root, int path_len, mount_trie* mounts) {
+  walk_item* item = new_walk_item(NULL, mounts, root, path_len, NULL);
+  CHECK_NULL(item, ERR_ABORT);
+
+  atomic_store(&walk_status, 0);
+  walk_root_id = ERR_IGNORE;
+
+  if (!pool_run(walk_pool, &process_walk_item, item)) {
+    free(item);
+    return ERR_ABORT;
+  }
+
+  int status = atomic_load(&walk_status);
+  if (status < 0) {
+    if (walk_root_id >= 0) {
+      rm_watch(walk_root_id);
+    }
+    return status;
+  }
+  return walk_root_id;
+}
+
+
 int watch(const char* root, array* mounts) {
   bool recursive = true;
   if (root[0] == '|') {
@@ -317,7 +977,7 @@ int watch(const char* root, array* mounts) {
   }
 
   struct stat st;
-  if (stat(root, &st) != 0) {
+  if (backend->stat(root, &st) != 0) {
     if (errno == ENOENT) {
       return ERR_MISSING;
     }
@@ -339,54 +999,435 @@ int watch(const char* root, array* mounts) {
     return ERR_IGNORE;
   }
 
-  memcpy(path_buf, root, path_len);
-  path_buf[path_len] = '\0';
-  return walk_tree(path_len, NULL, recursive, mounts);
+  mount_trie* trie;
+  int result = build_mount_trie(root, path_len, mounts, &trie);
+  if (result < 0) {
+    return result;
+  }
+
+  if (recursive && walk_pool != NULL) {
+    result = walk_tree_parallel(root, path_len, trie);
+  }
+  else {
+    memcpy(path_buf, root, path_len);
+    path_buf[path_len] = '\0';
+    result = walk_tree(path_len, NULL, recursive, trie);
+  }
+
+  delete_mount_trie(trie);
+  return result;
 }
 
 
 void unwatch(int id) {
-  rm_watch(id, true);
+  rm_watch(id);
+}
+
+
+int get_watch_limit() {
+  int count = backend->watch_limit();  // the limit is a sysctl and may be raised at runtime
+  if (count > 0) {
+    watch_count = count;
+  }
+  return watch_count;
+}
+
+int get_watch_path(int wd, char* buf, int buf_size) {
+  watch_node* node = table_get(watches, wd);
+  return (node != NULL ? node_path(node, buf, buf_size) : -1);
+}
+
+// the watch of a directory within the tree of the root watch `root_id`, or -1 when it is not watched
+int get_watch_id(int root_id, const char* path) {
+  watch_node* node = table_get(watches, root_id);
+  if (node == NULL || node->parent != NO_NODE) {
+    return -1;
+  }
+  int root_len = intern_length(node->name);
+  if (strncmp(intern_get(node->name), path, root_len) != 0 || (path[root_len] != '\0' && path[root_len] != '/')) {
+    return -1;
+  }
+
+  for (const char* p = path + root_len; *p == '/'; ) {
+    const char* name = p + 1;
+    int name_len = strcspn(name, "/");
+    uint32_t name_id = intern_find(name, name_len);
+    uint32_t kid = (name_id != NO_STRING ? find_kid(index_of(node), name_id) : NO_NODE);
+    if (kid == NO_NODE) {
+      return -1;
+    }
+    node = node_at(kid);
+    p = name + name_len;
+  }
+  return node->wd;
+}
+
+int get_watch_usage() {
+  return table_size(watches);
+}
+
+// node slabs, the child index, the watch table and interned names
+size_t get_watch_memory() {
+  return (size_t)chunk_count * NODE_CHUNK_SIZE + sizeof(node_chunk*) * chunk_capacity +
+         sizeof(uint32_t) * kid_index_capacity + table_memory(watches) + intern_memory();
+}
+
+void get_inotify_stats(inotify_stats* out) {
+  *out = stats;
+}
+
+
+// a directory waiting for its watch in the prioritized walk
+typedef struct {
+  int priority;
+  int depth;
+  int root;  // index into the roots (and ids) of the walk
+  uint32_t parent;
+  mount_trie* mounts;
+  int path_len;
+  char path[];
+} plan_item;
+
+// max-heap by priority; shallower directories come first among equals
+static bool plan_before(plan_item* a, plan_item* b) {
+  return a->priority > b->priority || (a->priority == b->priority && a->depth < b->depth);
+}
+
+static bool plan_push(array* heap, plan_item* item) {
+  CHECK_NULL(array_push(heap, item), false);
+  for (int i = array_size(heap) - 1; i > 0; ) {
+    int up = (i - 1) / 2;
+    plan_item* parent = array_get(heap, up);
+    if (!plan_before(item, parent)) break;
+    array_put(heap, i, parent);
+    array_put(heap, up, item);
+    i = up;
+  }
+  return true;
+}
+
+static plan_item* plan_pop(array* heap) {
+  int n = array_size(heap);
+  if (n == 0) {
+    return NULL;
+  }
+  plan_item* top = array_get(heap, 0);
+  plan_item* last = array_pop(heap);
+  if (--n == 0) {
+    return top;
+  }
+
+  int i = 0;
+  array_put(heap, 0, last);
+  while (true) {
+    int best = i, l = 2 * i + 1, r = l + 1;
+    if (l < n && plan_before(array_get(heap, l), array_get(heap, best))) best = l;
+    if (r < n && plan_before(array_get(heap, r), array_get(heap, best))) best = r;
+    if (best == i) break;
+    array_put(heap, i, array_get(heap, best));
+    array_put(heap, best, last);
+    i = best;
+  }
+  return top;
+}
+
+static plan_item* new_plan_item(plan_item* parent, const char* path, int path_len, const char* name) {
+  int name_len = (name != NULL ? strlen(name) + 1 : 0);
+  plan_item* item = malloc(sizeof(plan_item) + path_len + name_len + 1);
+  CHECK_NULL(item, NULL);
+  memcpy(item->path, path, path_len);
+  if (name != NULL) {
+    item->path[path_len] = '/';
+    memcpy(item->path + path_len + 1, name, name_len);
+  }
+  item->path_len = path_len + name_len;
+  item->path[item->path_len] = '\0';
+  item->priority = path_priority(item->path);
+  item->depth = (parent != NULL ? parent->depth + 1 : 0);
+  item->root = (parent != NULL ? parent->root : -1);
+  item->parent = NO_NODE;
+  item->mounts = NULL;
+  return item;
+}
+
+// watches one directory of the prioritized walk and queues its subdirectories
+static int plan_dir(plan_item* item, array* heap) {
+  void* dir = backend->open_dir(item->path);
+  if (dir == NULL) {
+    userlog(LOG_DEBUG, "opendir(%s): %d", item->path, errno);
+    return (errno == EACCES || errno == ENOENT || errno == ENOTDIR ? ERR_IGNORE : ERR_CONTINUE);
+  }
+
+  int id = add_watch(item->path, item->path_len, item->parent != NO_NODE ? node_at(item->parent) : NULL);
+  if (id < 0) {
+    backend->close_dir(dir);
+    return id;
+  }
+
+  watch_node* node = table_get(watches, id);
+  prune_kids(node, dir, item->path, item->path_len);
+  snapshot_dir(id, backend->dir_fd(dir), item->path);
+
+  const char* name;
+  bool unknown;
+  while ((name = backend->next_subdir(dir, &unknown)) != NULL) {
+    if (is_excluded_dir(item->path, item->path_len, name)) {
+      continue;
+    }
+
+    bool excluded;
+    mount_trie* kid_mounts = descend_mounts(item->mounts, name, item->path, &excluded);
+    if (excluded || (unknown && !backend->stat_subdir(dir, name))) {
+      continue;
+    }
+
+    plan_item* kid = new_plan_item(item, item->path, item->path_len, name);
+    if (kid == NULL) {
+      id = ERR_ABORT;
+      break;
+    }
+    kid->parent = index_of(node);
+    kid->mounts = kid_mounts;
+    if (!plan_push(heap, kid)) {
+      free(kid);
+      id = ERR_ABORT;
+      break;
+    }
+  }
+
+  backend->close_dir(dir);
+  return id;
 }
 
+// Walks recursive roots together, best directories first (see path_priority()), for as long as the number
+// of watches stays within the budget; directories left over are added to the uncovered list.
+// The effective priority never grows down the tree, so parents are always watched before their kids.
+// With `parents`, a "root" may also be a directory below the watch given there (or -1 for an actual root),
+// which extends that tree instead.
+bool watch_prioritized(array* roots, array* root_mounts, const int* parents, int* ids, int budget) {
+  int n = array_size(roots);
+  for (int i=0; i<n; i++) {
+    ids[i] = ERR_LIMIT;
+  }
+
+  array* heap = array_create(1024);
+  mount_trie** tries = calloc(n > 0 ? n : 1, sizeof(mount_trie*));
+  if (heap == NULL || tries == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    array_delete(heap);
+    free(tries);
+    return false;
+  }
+  bool result = true;
+
+  for (int i=0; i<n; i++) {
+    const char* root = array_get(roots, i);
+    int path_len = strlen(root);
+
+    watch_node* parent = (parents != NULL && parents[i] >= 0 ? table_get(watches, parents[i]) : NULL);
+    if (parents != NULL && parents[i] >= 0 && parent == NULL) {
+      ids[i] = ERR_IGNORE;
+      continue;
+    }
+
+    struct stat st;
+    if (backend->stat(root, &st) != 0 || !S_ISDIR(st.st_mode)) {
+      ids[i] = (parent == NULL ? watch(root, array_get(root_mounts, i)) : ERR_IGNORE);
+      continue;
+    }
+
+    int trie_result = build_mount_trie(root, path_len, array_get(root_mounts, i), &tries[i]);
+    if (trie_result < 0) {
+      ids[i] = trie_result;
+      continue;
+    }
+
+    plan_item* item = new_plan_item(NULL, root, path_len, NULL);
+    if (item == NULL || !plan_push(heap, item)) {
+      free(item);
+      result = false;
+      break;
+    }
+    item->root = i;
+    item->mounts = tries[i];
+    item->parent = (parent != NULL ? index_of(parent) : NO_NODE);
+  }
+
+  plan_item* item;
+  while ((item = plan_pop(heap)) != NULL) {
+    if (!result) {
+      free(item);
+      continue;
+    }
+
+    if (table_size(watches) >= budget) {
+      result = uncovered_add(item->path);
+      free(item);
+      continue;
+    }
+
+    int id = plan_dir(item, heap);
+    if (id == ERR_LIMIT) {
+      result = uncovered_add(item->path);
+    }
+    else if (id == ERR_ABORT) {
+      result = false;
+    }
+    if (item->depth == 0) {
+      ids[item->root] = id;
+    }
+    free(item);
+  }
+
+  for (int i=0; i<n; i++) {
+    delete_mount_trie(tries[i]);
+  }
+  free(tries);
+  array_delete(heap);
+  return result;
+}
+
+
+// an unpaired IN_MOVED_FROM: the entry has left watched trees
+static void flush_pending_move() {
+  if (pending_move.path == NULL) {
+    return;
+  }
+  if (callback != NULL) {
+    (*callback)(pending_move.path, pending_move.mask);
+  }
+  if (pending_move.wd >= 0) {
+    rm_watch(pending_move.wd);
+  }
+  free(pending_move.path);
+  pending_move.path = NULL;
+  pending_move.wd = -1;
+}
+
+static void hold_move(struct inotify_event* event, watch_node* parent, bool is_dir) {
+  pending_move.path = strdup(path_buf);
+  if (pending_move.path == NULL) {
+    userlog(LOG_ERR, "out of memory");
+  }
+  pending_move.cookie = event->cookie;
+  pending_move.mask = event->mask;
+  pending_move.wd = -1;
+  if (is_dir) {
+    uint32_t name = intern_find(event->name, strlen(event->name));
+    uint32_t kid = (name != NO_STRING ? find_kid(index_of(parent), name) : NO_NODE);
+    if (kid != NO_NODE) {
+      pending_move.wd = node_at(kid)->wd;
+    }
+  }
+  if (pending_move.path == NULL && pending_move.wd >= 0) {
+    rm_watch(pending_move.wd);
+  }
+}
+
+// attaches a watched subtree to its new parent under the new name; watches stay as they are
+static bool reparent(watch_node* node, watch_node* parent, const char* name) {
+  uint32_t name_id = intern_string(name, strlen(name));
+  if (name_id == NO_STRING) {
+    userlog(LOG_ERR, "out of memory");
+    return false;
+  }
+
+  uint32_t index = index_of(node), parent_index = index_of(parent);
+  uint32_t stale = find_kid(parent_index, name_id);
+  if (stale != NO_NODE && stale != index) {
+    rm_watch(node_at(stale)->wd);
+  }
+
+  unlink_node(index);
+  intern_release(node->name);
+  node->name = name_id;
+  if (!link_node(index, parent_index)) {
+    userlog(LOG_ERR, "out of memory");
+    return false;
+  }
+  return true;
+}
+
+// the second half of a rename within watched trees
+static bool complete_move(struct inotify_event* event, watch_node* parent, int path_len, int parent_len, bool is_dir) {
+  watch_node* moved = (pending_move.wd >= 0 ? table_get(watches, pending_move.wd) : NULL);
+  bool excluded = is_dir && is_excluded_dir(path_buf, parent_len, event->name);
+  if (moved != NULL && (excluded || has_path_patterns())) {
+    // what is excluded inside the subtree might depend on its location
+    rm_watch(pending_move.wd);
+    moved = NULL;
+  }
+  bool ok = (moved == NULL || reparent(moved, parent, event->name));
+  userlog(LOG_DEBUG, "moved %s -> %s (%s)", pending_move.path, path_buf, moved != NULL ? "in place" : "rewalk");
+  stats.events_coalesced++;
+
+  if (move_callback != NULL) {
+    (*move_callback)(pending_move.path, path_buf, is_dir);
+  }
+  free(pending_move.path);
+  pending_move.path = NULL;
+  pending_move.wd = -1;
+
+  if (ok && moved == NULL && is_dir && !excluded) {
+    int result = walk_tree(path_len, parent, true, NULL);
+    ok = (result >= 0 || result == ERR_IGNORE || result == ERR_CONTINUE);
+  }
+  return ok;
+}
 
 static bool process_inotify_event(struct inotify_event* event) {
+  uint64_t trace_start = TRACE_START();
+  PROBE2(event__start, event->wd, event->mask);
   watch_node* node = table_get(watches, event->wd);
   if (node == NULL) {
     return true;
   }
 
   bool is_dir = (event->mask & IN_ISDIR) == IN_ISDIR;
-  userlog(LOG_DEBUG, "inotify: wd=%d mask=%d dir=%d name=%s", event->wd, event->mask & (~IN_ISDIR), is_dir, node->path);
 
-  int path_len = node->path_len;
-  memcpy(path_buf, node->path, path_len + 1);
+  int path_len = node_path(node, path_buf, PATH_MAX);
+  if (path_len < 0) {
+    userlog(LOG_WARNING, "path too long: wd=%d", event->wd);
+    return true;
+  }
+  userlog(LOG_DEBUG, "inotify: wd=%d mask=%d dir=%d name=%s", event->wd, event->mask & (~IN_ISDIR), is_dir, path_buf);
+
+  int parent_len = path_len;
   if (event->len > 0) {
     path_buf[path_len] = '/';
     int name_len = strlen(event->name);
     memcpy(path_buf + path_len + 1, event->name, name_len + 1);
     path_len += name_len + 1;
+    snapshot_update(event->wd, path_buf, event->name,
+                    event->mask & (IN_CREATE | IN_MOVED_TO), event->mask & (IN_DELETE | IN_MOVED_FROM));
+  }
+  PROBE1(event__done, path_buf);
+  TRACE_END(TRACE_EVENT, trace_start);
+
+  if (event->mask & IN_MOVED_FROM) {
+    hold_move(event, node, is_dir);
+    return true;
+  }
+  if (event->mask & IN_MOVED_TO && pending_move.path != NULL && pending_move.cookie == event->cookie) {
+    return complete_move(event, node, path_len, parent_len, is_dir);
   }
 
   if (callback != NULL) {
     (*callback)(path_buf, event->mask);
   }
 
-  if (is_dir && event->mask & (IN_CREATE | IN_MOVED_TO)) {
+  if (is_dir && event->mask & (IN_CREATE | IN_MOVED_TO) && !is_excluded_dir(path_buf, parent_len, event->name)) {
     int result = walk_tree(path_len, node, true, NULL);
     if (result < 0 && result != ERR_IGNORE && result != ERR_CONTINUE) {
       return false;
     }
   }
 
-  if (is_dir && event->mask & (IN_DELETE | IN_MOVED_FROM)) {
-    for (int i=0; i<array_size(node->kids); i++) {
-      watch_node* kid = array_get(node->kids, i);
-      if (kid != NULL && strncmp(path_buf, kid->path, kid->path_len) == 0) {
-        rm_watch(kid->wd, false);
-        array_put(node->kids, i, NULL);
-        break;
-      }
+  if (is_dir && event->mask & IN_DELETE) {
+    uint32_t name = intern_find(event->name, strlen(event->name));
+    uint32_t kid = (name != NO_STRING ? find_kid(index_of(node), name) : NO_NODE);
+    if (kid != NO_NODE) {
+      rm_watch(node_at(kid)->wd);
     }
   }
 
@@ -394,41 +1435,173 @@ static bool process_inotify_event(struct inotify_event* event) {
 }
 
 
-bool process_inotify_input() {
-  ssize_t len = read(inotify_fd, event_buf, EVENT_BUF_LEN);
-  if (len < 0) {
-    userlog(LOG_ERR, "read: %s", strerror(errno));
-    return false;
+// an event from a read() batch; overflow is handled once the batch is over
+static bool dispatch_event(struct inotify_event* event, bool* overflow) {
+  stats.events_read++;
+
+  if (pending_move.path != NULL && !(event->mask & IN_MOVED_TO && event->cookie == pending_move.cookie)) {
+    flush_pending_move();
+  }
+  if (event->mask & IN_IGNORED) {
+    // the kernel has dropped the watch (directory deleted or unmounted) - forget it, if still known
+    rm_watch(event->wd);
+    return true;
+  }
+  if (event->mask & IN_Q_OVERFLOW) {
+    userlog(LOG_INFO, "event queue overflow");
+    if (*overflow) {
+      stats.events_coalesced++;
+    }
+    *overflow = true;
+    return true;
   }
 
-  int i = 0;
-  while (i < len) {
-    struct inotify_event* event = (struct inotify_event*) &event_buf[i];
-    i += EVENT_SIZE + event->len;
+  return process_inotify_event(event);
+}
 
-    if (event->mask & IN_IGNORED) {
-      continue;
+static void finish_batch(bool overflow) {
+  flush_pending_move();
+
+  if (overflow) {
+    if (event_buf_len < MAX_EVENT_BUF_LEN) {
+      char* new_buf = realloc(event_buf, event_buf_len * 2);
+      if (new_buf != NULL) {
+        event_buf = new_buf;
+        event_buf_len *= 2;
+        userlog(LOG_INFO, "event buffer enlarged to %zu", event_buf_len);
+      }
     }
-    if (event->mask & IN_Q_OVERFLOW) {
-      userlog(LOG_INFO, "event queue overflow");
-      continue;
+    if (callback != NULL) {
+      (*callback)("", IN_Q_OVERFLOW);
     }
+  }
+}
 
-    if (!process_inotify_event(event)) {
+bool process_inotify_input() {
+  bool overflow = false;
+
+  while (true) {
+    uint64_t trace_start = TRACE_START();
+    PROBE(read__start);
+    ssize_t len = backend->read_events(event_buf, event_buf_len);
+    PROBE1(read__done, len);
+    if (len >= 0) {
+      TRACE_END(TRACE_READ, trace_start);
+    }
+    if (len < 0) {
+      if (errno == EAGAIN) {
+        break;
+      }
+      else if (errno == EINTR) {
+        continue;
+      }
+      userlog(LOG_ERR, "read: %s", strerror(errno));
+      flush_pending_move();
       return false;
     }
+
+    int i = 0;
+    while (i < len) {
+      struct inotify_event* event = (struct inotify_event*) &event_buf[i];
+      i += EVENT_SIZE + event->len;
+      record_append(RECORD_EVENT, event->wd, -1, event, EVENT_SIZE + event->len);
+
+      if (!dispatch_event(event, &overflow)) {
+        return false;
+      }
+    }
   }
 
+  record_append(RECORD_READ_END, -1, -1, NULL, 0);
+  finish_batch(overflow);
   return true;
 }
 
+// Feeds a recording through event processing at full speed, with the recorded watch tree changes standing in
+// for the kernel and the disk. `batch_done` is called where the recorded process went back to its event loop.
+bool replay_inotify(const char* name, void (* batch_done)(), uint64_t* events) {
+  if (!replay_open(name)) {
+    return false;
+  }
+  replaying = true;
+
+  record_type type;
+  int wd, parent;
+  const char* payload;
+  uint32_t len;
+  bool overflow = false, result = true;
+  *events = 0;
+  while (result && replay_next(&type, &wd, &parent, &payload, &len)) {
+    switch (type) {
+      case RECORD_EVENT: {
+        // names are copied into path_buf unchecked, so only what the kernel could have produced is accepted
+        struct inotify_event* event = (struct inotify_event*)payload;
+        if (len < EVENT_SIZE || len != EVENT_SIZE + event->len || event->len > NAME_MAX + 1 ||
+            (event->len > 0 && memchr(event->name, '\0', event->len) == NULL)) {
+          userlog(LOG_ERR, "replay: malformed event");
+          result = false;
+          break;
+        }
+        (*events)++;
+        result = dispatch_event(event, &overflow);
+        break;
+      }
+
+      case RECORD_READ_END:
+        finish_batch(overflow);
+        overflow = false;
+        (*batch_done)();
+        break;
+
+      case RECORD_WATCH: {
+        watch_node* parent_node = (parent >= 0 ? table_get(watches, parent) : NULL);
+        if (parent >= 0 && parent_node == NULL) {
+          userlog(LOG_WARNING, "replay: unknown parent %d of %s", parent, payload);
+          break;
+        }
+        if (len >= PATH_MAX) {
+          userlog(LOG_ERR, "replay: malformed path");
+          result = false;
+          break;
+        }
+        memcpy(path_buf, payload, len + 1);
+        int id = register_watch(wd, path_buf, len, parent_node);
+        result = (id >= 0 || id == ERR_IGNORE);
+        break;
+      }
+
+      case RECORD_UNWATCH:
+        rm_watch(wd);
+        break;
+
+      default:
+        userlog(LOG_WARNING, "replay: unknown record %d", type);
+        break;
+    }
+  }
+
+  finish_batch(overflow);
+  replay_close();
+  replaying = false;
+  return result;
+}
+
 
 void close_inotify() {
+  pool_delete(walk_pool);
+
   if (watches != NULL) {
     table_delete(watches);
   }
 
+  free(pending_move.path);
+  pending_move.path = NULL;
+  free_node_chunks();
+  intern_cleanup();
+  free(event_buf);
+
   if (inotify_fd >= 0) {
-    close(inotify_fd);
+    backend->close();
+    inotify_fd = -1;
   }
 }
@@ -17,16 +17,18 @@
 #include "fsnotifier.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
-#include <mntent.h>
-#include <paths.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/inotify.h>
-#include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #define LOG_ENV "FSNOTIFIER_LOG_LEVEL"
@@ -36,13 +38,28 @@
 #define LOG_ENV_ERROR "error"
 #define LOG_ENV_OFF "off"
 
+#define BACKEND_ENV "FSNOTIFIER_BACKEND"
+#define BACKEND_ENV_FANOTIFY "fanotify"
+
 
 #define USAGE_MSG \
     "fsnotifier - IntelliJ IDEA companion program for watching and reporting file and directory structure modifications.\n\n" \
     "fsnotifier utilizes \"user\" facility of syslog(3) - messages usually can be found in /var/log/user.log.\n" \
     "Verbosity is regulated via " LOG_ENV " environment variable, possible values are: " \
-    LOG_ENV_DEBUG ", " LOG_ENV_INFO ", " LOG_ENV_WARNING ", " LOG_ENV_ERROR ", " LOG_ENV_OFF "; default is " LOG_ENV_WARNING ".\n\n" \
-    "Use 'fsnotifier --selftest' to perform some self-diagnostics (output will be logged and printed to console).\n"
+    LOG_ENV_DEBUG ", " LOG_ENV_INFO ", " LOG_ENV_WARNING ", " LOG_ENV_ERROR ", " LOG_ENV_OFF "; default is " LOG_ENV_WARNING ".\n" \
+    "Initial tree walk uses a pool of threads, the size can be set via " WALK_THREADS_ENV " environment variable (1 disables it).\n" \
+    "Setting " BACKEND_ENV " to " BACKEND_ENV_FANOTIFY " enables filesystem-wide fanotify(7) marks (falls back to inotify when unavailable).\n" \
+    "Network and FUSE mounts are polled by a pool of threads, the size can be set via " POLL_THREADS_ENV " environment variable " \
+    "(0 disables polling, such mounts are then reported as unwatchable).\n" \
+    "Setting " SNAPSHOT_ENV " to 1 keeps listings of watched directories in memory, so that lost events are recovered " \
+    "by reporting the actual differences instead of asking for a rescan. " \
+    "With " SNAPSHOT_FILE_ENV " set, listings are also saved to the given file on exit, and changes made meanwhile " \
+    "are reported on the next start.\n" \
+    "Setting " TRACE_ENV " to 1 keeps latency histograms of event processing stages (see the TRACE command).\n" \
+    "Setting " RECORD_ENV " to a file name records inotify events and watch changes to that file.\n\n" \
+    "Use 'fsnotifier --selftest' to perform some self-diagnostics (output will be logged and printed to console).\n" \
+    "Use 'fsnotifier --replay <file>' to process a recording at full speed (output is printed, timing goes to stderr).\n" \
+    "Use 'fsnotifier --simulate <depth> <fan-out>' to time watching and unwatching a simulated tree of that shape.\n"
 
 #define HELP_MSG \
     "Try 'fsnotifier --help' for more information.\n"
@@ -56,32 +73,128 @@
     "<a href=\"https://confluence.jetbrains.com/display/IDEADEV/Inotify+Watches+Limit\">More details.</a>\n"
 
 #define MISSING_ROOT_TIMEOUT 1
+#define UNCOVERED_POLL_TICKS 15
+#define MIN_BUDGET_GROWTH 64  // spare watches worth a walk of uncovered directories,
+#define BUDGET_GROWTH_SHARE 8  // or this share of the budget, whichever is more
+
+#define MAX_EPOLL_EVENTS 4
+
+#define OUTPUT_BUF_LEN 4096
+#define OUTPUT_FLUSH_THRESHOLD (64 * 1024)
+
+// protocol extensions a client may ask for with the FEATURES command
+// a rename within watched trees is reported as three lines, "MOVE", the old path and the new one,
+// instead of DELETE + CREATE + CHANGE
+#define FEATURE_MOVE 1
+#define FEATURE_BINARY 2  // events are sent as binary records (below), the rest of the protocol in TEXT records
+#define FEATURE_TIMESTAMPS 4  // binary records carry the time of reporting (nanoseconds since the epoch)
+
+// A binary record: type (1 byte), flags (1), path length (2), root key (4), [timestamp (8)], path; little-endian.
+// Paths are relative to the root announced by a ROOT record with the same key (key 0 means an absolute path).
+// A CREATE is not followed by a CHANGE of the same path. TEXT records carry pieces of the text protocol
+// instead of a path, with their length in the root key field.
+enum {
+  BIN_TEXT, BIN_CREATE, BIN_CHANGE, BIN_STATS, BIN_DELETE, BIN_DIRTY, BIN_RECDIRTY, BIN_MOVE_FROM, BIN_MOVE_TO, BIN_ROOT
+};
+
+#define BIN_FLAG_TIMESTAMP 1
+#define BIN_HEADER_LEN 8
 
 #define UNFLATTEN(root) (root[0] == '|' ? root + 1 : root)
 
+typedef enum {
+  BACKEND_INOTIFY, BACKEND_FANOTIFY, BACKEND_POLL
+} backend_type;
+
 typedef struct {
   char* path;
   int id;  // negative value means missing root
+  array* unwatchable;  // inner mount points, reported to the client unless polled
+  int* mount_ids;  // poll registrations of `unwatchable` mounts
+  backend_type backend;  // where `id` comes from
+  bool awaited;  // missing root watched for by a sentinel (otherwise it is stat'ed periodically)
+  int64_t walk_time;  // of the last walk, in microseconds
+  uint32_t key;  // identifies the root in binary records
+  bool announced;  // a ROOT record has been sent
 } watch_root;
 
 static array* roots = NULL;
 
 static int log_level = 0;
 static bool self_test = false;
+static const char* replay_name = NULL;
+static bool simulate = false;
+static bool use_fanotify = false;
+static bool use_polling = false;
+static bool use_snapshots = false;
+static int features = 0;
+static uint32_t last_root_key = 0;
+static int poll_ticks = 0;
+
+static int timer_fd = -1;
+static bool timer_armed = false;
+
+static char* output_buf = NULL;
+static size_t output_len = 0;
+static size_t output_cap = 0;
+static size_t text_record = SIZE_MAX;  // offset of the TEXT record being extended
+static size_t create_record = SIZE_MAX;  // offset of the last record, when it is a CREATE
+static watch_root* last_path_root = NULL;
+
+// counters for the STATS command (the rest are kept by the inotify subsystem)
+static uint64_t events_emitted = 0;
+static uint64_t overflow_count = 0;
+static uint64_t bytes_written = 0;
+static uint64_t records_coalesced = 0;  // binary protocol only, inotify coalesces the rest
 
 static void init_log();
 static void run_self_test();
+static bool run_replay();
+static bool run_simulation();
 static bool main_loop();
+static bool event_loop(int epoll_fd, int input_fd, bool input_ready);
+static void update_timer();
+static bool add_to_epoll(int epoll_fd, int fd, uint32_t events);
 static int read_input();
+static int read_list(array* list);
+static bool update_excludes(array* patterns);
+static bool update_priorities(array* lines);
+static bool update_features(array* names);
+static void report_stats();
+static void report_latency();
+static bool rebalance_roots();
+static bool watch_uncovered(int budget);
+static void report_uncovered();
+static void check_uncovered();
 static bool update_roots(array* new_roots);
+static bool diff_roots(array* new_roots, array* added);
+static bool roots_overlap(const char* root1, const char* root2);
 static void unregister_roots();
-static bool register_roots(array* new_roots, array* unwatchable, array* mounts);
-static array* unwatchable_mounts();
+static void unregister_root(watch_root* root);
+static bool register_roots(array* new_roots, array* unwatchable);
+static int watch_root_path(watch_root* root, array* mounts);
+static void unwatch_root(watch_root* root);
+static void poll_mounts(watch_root* root, array* mounts);
 static void inotify_callback(const char* path, int event);
+static void move_callback(const char* from, const char* to, bool is_dir);
 static void report_event(const char* event, const char* path);
+static bool report_record(int type, const char* path);
+static void announce_roots();
+static void output_line(const char* path);
 static void output(const char* format, ...);
+static bool begin_text();
+static void end_text();
+static bool output_reserve(size_t len);
+static void flush_output();
 static void check_missing_roots();
+static void report_unsaved_roots();
+static void await_root(watch_root* root);
+static void sentinel_callback(const char* path, bool appeared);
+static void restore_root(watch_root* root);
 static void check_root_removal(const char*);
+static void recover_from_overflow(const char* path);
+static bool rewatch_root(watch_root* root);
+static int64_t now_us();
 
 
 int main(int argc, char** argv) {
@@ -97,6 +210,15 @@ int main(int argc, char** argv) {
     else if (strcmp(argv[1], "--selftest") == 0) {
       self_test = true;
     }
+    else if (strcmp(argv[1], "--replay") == 0 && argc > 2) {
+      replay_name = argv[2];
+      set_watch_backend(&replay_backend);
+    }
+    else if (strcmp(argv[1], "--simulate") == 0 && argc > 3 && atoi(argv[2]) >= 0 && atoi(argv[3]) > 0) {
+      simulate = true;
+      sim_configure(atoi(argv[2]), atoi(argv[3]));
+      set_watch_backend(&sim_backend);
+    }
     else {
       printf("unrecognized option: %s\n", argv[1]);
       printf(HELP_MSG);
@@ -113,16 +235,58 @@ int main(int argc, char** argv) {
   }
 
   setvbuf(stdin, NULL, _IONBF, 0);
+  init_tracing();
 
   int rv = 0;
   roots = array_create(20);
+  init_mount_table();
   if (roots != NULL && init_inotify()) {
     set_inotify_callback(&inotify_callback);
+    set_move_callback(&move_callback);
 
-    if (!self_test) {
+    char* backend = getenv(BACKEND_ENV);
+    if (backend != NULL && strcmp(backend, BACKEND_ENV_FANOTIFY) == 0) {
+      use_fanotify = init_fanotify();
+      if (use_fanotify) {
+        set_fanotify_callback(&inotify_callback);
+      }
+      else {
+        userlog(LOG_WARNING, "fanotify is not available, using inotify");
+      }
+    }
+
+    // a replay only feeds the recording through event processing; nothing on the disk is watched or polled
+    if (replay_name == NULL && init_sentinels()) {
+      set_sentinel_callback(&sentinel_callback);
+    }
+
+    use_polling = (replay_name == NULL && init_polling());
+    if (use_polling) {
+      set_poll_callback(&inotify_callback);
+    }
+
+    if (replay_name == NULL && !simulate) {
+      use_snapshots = init_snapshots();
+    }
+
+    if (replay_name != NULL) {
+      if (!run_replay()) {
+        rv = 3;
+      }
+    }
+    else if (simulate) {
+      if (!run_simulation()) {
+        rv = 3;
+      }
+    }
+    else if (!self_test) {
+      init_recording();
       if (!main_loop()) {
         rv = 3;
       }
+      else {
+        snapshot_save();
+      }
     }
     else {
       run_self_test();
@@ -134,9 +298,21 @@ int main(int argc, char** argv) {
     output("GIVEUP\n");
     rv = 2;
   }
+  close_polling();
+  close_sentinels();
+  close_fanotify();
   close_inotify();
+  close_snapshots();
+  close_recording();
+  close_mount_table();
+  clear_exclude_patterns();
+  close_budget();
   array_delete(roots);
 
+  flush_output();
+  free(output_buf);
+  close_tracing();
+
   userlog(LOG_INFO, "finished (%d)", rv);
   closelog();
 
@@ -218,38 +394,183 @@ static void run_self_test() {
 }
 
 
+static bool run_replay() {
+  uint64_t events;
+  int64_t start = now_us();
+  bool result = replay_inotify(replay_name, &flush_output, &events);
+  flush_output();
+  int64_t elapsed = now_us() - start;
+  fprintf(stderr, "replayed %" PRIu64 " events in %.1f ms (%.0f events/s)%s\n", events, elapsed / 1e3,
+          elapsed > 0 ? events * 1e6 / elapsed : 0.0, result ? "" : ", stopped on error");
+  return result;
+}
+
+
+static bool run_simulation() {
+  array* mounts = array_create(1);
+  CHECK_NULL(mounts, false);
+
+  printf("simulated tree: %" PRIu64 " directories\n", sim_directory_count());
+  int64_t start = now_us();
+  int id = watch(SIM_ROOT, mounts);
+  int64_t elapsed = now_us() - start;
+  if (id < 0) {
+    printf("watch failed: %d\n", id);
+    array_delete(mounts);
+    return false;
+  }
+  int watches = get_watch_usage();
+  printf("watched in %.1f ms (%.2f us per directory), %d watches, watch tree %zu bytes (%.1f per watch)\n",
+         elapsed / 1e3, watches > 0 ? (double)elapsed / watches : 0.0, watches, get_watch_memory(),
+         watches > 0 ? (double)get_watch_memory() / watches : 0.0);
+
+  start = now_us();
+  unwatch(id);
+  elapsed = now_us() - start;
+  printf("unwatched in %.1f ms (%.2f us per directory)\n", elapsed / 1e3, watches > 0 ? (double)elapsed / watches : 0.0);
+
+  array_delete(mounts);
+  return true;
+}
+
+
 static bool main_loop() {
-  int input_fd = fileno(stdin), inotify_fd = get_inotify_fd();
-  int nfds = (inotify_fd > input_fd ? inotify_fd : input_fd) + 1;
-  fd_set rfds;
-  struct timeval timeout;
+  int input_fd = fileno(stdin), fanotify_fd = get_fanotify_fd(), sentinel_fd = get_sentinel_fd();
+  int poll_fd = get_poll_fd(), mounts_fd = get_mount_table_fd();
 
-  while (true) {
-    usleep(50000);
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    userlog(LOG_ERR, "epoll_create1: %s", strerror(errno));
+    return false;
+  }
 
-    FD_ZERO(&rfds);
-    FD_SET(input_fd, &rfds);
-    FD_SET(inotify_fd, &rfds);
-    timeout = (struct timeval){MISSING_ROOT_TIMEOUT, 0};
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd < 0) {
+    userlog(LOG_ERR, "timerfd_create: %s", strerror(errno));
+    close(epoll_fd);
+    return false;
+  }
 
-    if (select(nfds, &rfds, NULL, NULL, &timeout) < 0) {
-      if (errno != EINTR) {
-        userlog(LOG_ERR, "select: %s", strerror(errno));
-        return false;
+  // regular files and the like cannot be polled, but reading them never blocks either
+  bool input_ready = false;
+  struct epoll_event input_event = {.events = EPOLLIN, .data.fd = input_fd};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, input_fd, &input_event) < 0) {
+    if (errno != EPERM) {
+      userlog(LOG_ERR, "epoll_ctl(%d): %s", input_fd, strerror(errno));
+      close(timer_fd);
+      timer_fd = -1;
+      close(epoll_fd);
+      return false;
+    }
+    userlog(LOG_INFO, "input cannot be polled, reading it synchronously");
+    input_ready = true;
+  }
+
+  bool result = false;
+  if (add_to_epoll(epoll_fd, get_inotify_fd(), EPOLLIN) &&
+      add_to_epoll(epoll_fd, timer_fd, EPOLLIN) && (fanotify_fd < 0 || add_to_epoll(epoll_fd, fanotify_fd, EPOLLIN)) &&
+      (sentinel_fd < 0 || add_to_epoll(epoll_fd, sentinel_fd, EPOLLIN)) &&
+      (poll_fd < 0 || add_to_epoll(epoll_fd, poll_fd, EPOLLIN)) &&
+      (mounts_fd < 0 || add_to_epoll(epoll_fd, mounts_fd, EPOLLPRI))) {
+    result = event_loop(epoll_fd, input_fd, input_ready);
+  }
+
+  close(timer_fd);
+  timer_fd = -1;
+  close(epoll_fd);
+  return result;
+}
+
+static bool add_to_epoll(int epoll_fd, int fd, uint32_t events) {
+  struct epoll_event event = {.events = events, .data.fd = fd};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+    userlog(LOG_ERR, "epoll_ctl(%d): %s", fd, strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+static bool event_loop(int epoll_fd, int input_fd, bool input_ready) {
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+
+  while (true) {
+    int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, input_ready ? 0 : -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      userlog(LOG_ERR, "epoll_wait: %s", strerror(errno));
+      return false;
+    }
+
+    for (int i=0; i<n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == input_fd) {
+        int result = read_input();
+        if (result == 0) return true;
+        else if (result != ERR_CONTINUE) return false;
+      }
+      else if (fd == get_inotify_fd()) {
+        if (!process_inotify_input()) return false;
+      }
+      else if (fd == get_fanotify_fd()) {
+        if (!process_fanotify_input()) return false;
+      }
+      else if (fd == get_sentinel_fd()) {
+        if (!process_sentinel_input()) return false;
+      }
+      else if (fd == get_poll_fd()) {
+        if (!process_poll_input()) return false;
+      }
+      else if (fd == get_mount_table_fd()) {
+        mount_table_changed();
+      }
+      else if (fd == timer_fd) {
+        uint64_t expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+          check_missing_roots();
+          check_uncovered();
+        }
       }
     }
-    else if (FD_ISSET(input_fd, &rfds)) {
+
+    if (input_ready) {
       int result = read_input();
       if (result == 0) return true;
       else if (result != ERR_CONTINUE) return false;
     }
-    else if (FD_ISSET(inotify_fd, &rfds)) {
-      if (!process_inotify_input()) return false;
-    }
-    else {
-      check_missing_roots();
+
+    snapshot_report(&report_event);
+    if (take_uncovered_changes()) {
+      if (use_polling) {
+        poll_uncovered();
+      }
+      report_uncovered();
     }
+    update_timer();
+    flush_output();
+  }
+}
+
+// the timer only runs while there is something to poll: missing roots without a sentinel, or uncovered directories
+static void update_timer() {
+  bool needed = uncovered_count() > 0;
+  for (int i=0; i<array_size(roots) && !needed; i++) {
+    watch_root* root = array_get(roots, i);
+    needed = root->id < 0 && root->id != ERR_LIMIT && !root->awaited;
+  }
+  if (needed == timer_armed) {
+    return;
+  }
+
+  struct itimerspec timeout = {{0, 0}, {0, 0}};
+  if (needed) {
+    timeout.it_interval.tv_sec = timeout.it_value.tv_sec = MISSING_ROOT_TIMEOUT;
+  }
+  if (timerfd_settime(timer_fd, 0, &timeout, NULL) < 0) {
+    userlog(LOG_ERR, "timerfd_settime: %s", strerror(errno));
+    return;
   }
+  timer_armed = needed;
+  userlog(LOG_DEBUG, "timer %s", needed ? "armed" : "disarmed");
 }
 
 
@@ -265,24 +586,55 @@ static int read_input() {
   if (strcmp(line, "ROOTS") == 0) {
     array* new_roots = array_create(20);
     CHECK_NULL(new_roots, ERR_ABORT);
+    int result = read_list(new_roots);
+    if (result != ERR_CONTINUE) {
+      array_delete_vs_data(new_roots);
+      return result;
+    }
+    return update_roots(new_roots) ? ERR_CONTINUE : ERR_ABORT;
+  }
 
-    while (1) {
-      line = read_line(stdin);
-      userlog(LOG_DEBUG, "input: %s", (line ? line : "<null>"));
-      if (line == NULL || strlen(line) == 0) {
-        return 0;
-      }
-      else if (strcmp(line, "#") == 0) {
-        break;
-      }
-      else {
-        int l = strlen(line);
-        if (l > 1 && line[l-1] == '/')  line[l-1] = '\0';
-        CHECK_NULL(array_push(new_roots, strdup(line)), ERR_ABORT);
-      }
+  if (strcmp(line, "EXCLUDE") == 0) {
+    array* patterns = array_create(20);
+    CHECK_NULL(patterns, ERR_ABORT);
+    int result = read_list(patterns);
+    if (result != ERR_CONTINUE) {
+      array_delete_vs_data(patterns);
+      return result;
     }
+    return update_excludes(patterns) ? ERR_CONTINUE : ERR_ABORT;
+  }
 
-    return update_roots(new_roots) ? ERR_CONTINUE : ERR_ABORT;
+  if (strcmp(line, "PRIORITIES") == 0) {
+    array* lines = array_create(20);
+    CHECK_NULL(lines, ERR_ABORT);
+    int result = read_list(lines);
+    if (result != ERR_CONTINUE) {
+      array_delete_vs_data(lines);
+      return result;
+    }
+    return update_priorities(lines) ? ERR_CONTINUE : ERR_ABORT;
+  }
+
+  if (strcmp(line, "FEATURES") == 0) {
+    array* names = array_create(4);
+    CHECK_NULL(names, ERR_ABORT);
+    int result = read_list(names);
+    if (result != ERR_CONTINUE) {
+      array_delete_vs_data(names);
+      return result;
+    }
+    return update_features(names) ? ERR_CONTINUE : ERR_ABORT;
+  }
+
+  if (strcmp(line, "STATS") == 0) {
+    report_stats();
+    return ERR_CONTINUE;
+  }
+
+  if (strcmp(line, "TRACE") == 0) {
+    report_latency();
+    return ERR_CONTINUE;
   }
 
   userlog(LOG_WARNING, "unrecognised command: %s", line);
@@ -290,34 +642,191 @@ static int read_input() {
 }
 
 
+// reads lines up to the "#" terminator; returns 0 when the input is closed
+static int read_list(array* list) {
+  while (1) {
+    char* line = read_line(stdin);
+    userlog(LOG_DEBUG, "input: %s", (line ? line : "<null>"));
+    if (line == NULL || strlen(line) == 0) {
+      return 0;
+    }
+    else if (strcmp(line, "#") == 0) {
+      return ERR_CONTINUE;
+    }
+    else {
+      int l = strlen(line);
+      if (l > 1 && line[l-1] == '/')  line[l-1] = '\0';
+      CHECK_NULL(array_push(list, strdup(line)), ERR_ABORT);
+    }
+  }
+}
+
+
+// Directories matching the patterns are not watched; roots are re-walked so that watches
+// for newly excluded directories are dropped and the ones which are not excluded anymore are added.
+static bool update_excludes(array* patterns) {
+  userlog(LOG_INFO, "updating exclusions (%d)", array_size(patterns));
+
+  bool changed;
+  if (!set_exclude_patterns(patterns, &changed)) {
+    return false;
+  }
+  if (!changed) {
+    return true;
+  }
+
+  for (int i=0; i<array_size(roots); i++) {
+    watch_root* root = array_get(roots, i);
+    if (root->id >= 0 && root->backend == BACKEND_INOTIFY && UNFLATTEN(root->path) == root->path) {
+      rewatch_root(root);
+    }
+  }
+  if (use_polling) {
+    poll_reset();
+  }
+  return true;
+}
+
+// Priorities only matter when the watch budget does not cover all roots.
+static bool update_priorities(array* lines) {
+  userlog(LOG_INFO, "updating priorities (%d)", array_size(lines));
+
+  bool changed;
+  if (!set_priorities(lines, &changed)) {
+    return false;
+  }
+  return !changed || uncovered_count() == 0 || rebalance_roots();
+}
+
+static int feature_of(const char* name) {
+  return (strcmp(name, "MOVE") == 0 ? FEATURE_MOVE :
+          strcmp(name, "BINARY") == 0 ? FEATURE_BINARY :
+          strcmp(name, "TIMESTAMPS") == 0 ? FEATURE_TIMESTAMPS : 0);
+}
+
+// replaces the set of enabled features; the reply lists those which are supported
+// (the reply is sent in the protocol which was in effect before, binary records start right after it)
+static bool update_features(array* names) {
+  int new_features = 0;
+  for (int i=0; i<array_size(names); i++) {
+    new_features |= feature_of(array_get(names, i));
+  }
+  if (!(new_features & FEATURE_BINARY)) {
+    new_features &= ~FEATURE_TIMESTAMPS;  // only binary records carry them
+  }
+
+  output("FEATURES\n");
+  for (int i=0; i<array_size(names); i++) {
+    char* name = array_get(names, i);
+    if (new_features & feature_of(name)) {
+      output("%s\n", name);
+    }
+    else {
+      userlog(LOG_WARNING, "unsupported feature: %s", name);
+    }
+  }
+  output("#\n");
+
+  bool binary_started = (new_features & FEATURE_BINARY) && !(features & FEATURE_BINARY);
+  features = new_features;
+  text_record = create_record = SIZE_MAX;
+  if (binary_started) {
+    for (int i=0; i<array_size(roots); i++) {
+      ((watch_root*)array_get(roots, i))->announced = false;
+    }
+    announce_roots();
+  }
+
+  userlog(LOG_INFO, "features: %d", features);
+  array_delete_vs_data(names);
+  return true;
+}
+
+// counters since the start, one "<name> <value>" per line; walk times are per root, in microseconds
+// (the reply is not headed "STATS", which is an event already)
+static void report_stats() {
+  inotify_stats stats;
+  get_inotify_stats(&stats);
+
+  output("COUNTERS\n");
+  output("watches %d\n", get_watch_usage());
+  output("tree_memory %zu\n", get_watch_memory());
+  output("events_read %" PRIu64 "\n", stats.events_read);
+  output("events_emitted %" PRIu64 "\n", events_emitted);
+  output("events_coalesced %" PRIu64 "\n", stats.events_coalesced + records_coalesced);
+  output("overflows %" PRIu64 "\n", overflow_count);
+  output("watch_limit_hits %" PRIu64 "\n", stats.limit_hits);
+  output("bytes_written %" PRIu64 "\n", bytes_written);
+  for (int i=0; i<array_size(roots); i++) {
+    watch_root* root = array_get(roots, i);
+    if (root->id >= 0) {
+      output("walk_time %" PRId64 " ", root->walk_time);
+      output_line(UNFLATTEN(root->path));
+    }
+  }
+  output("#\n");
+}
+
+// latency histograms, one "<stage> <count> <p50> <p90> <p99> <p99.9> <max>" per line, in nanoseconds;
+// the block is empty unless tracing is enabled
+static void report_latency() {
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+  uint64_t values[5];
+
+  output("TRACE\n");
+  for (int stage=0; stage<TRACE_STAGES && trace_enabled; stage++) {
+    uint64_t count = trace_summary(stage, quantiles, values, 5);
+    output("%s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+           trace_stage_name(stage), count, values[0], values[1], values[2], values[3], values[4]);
+  }
+  output("#\n");
+}
+
 static bool update_roots(array* new_roots) {
   userlog(LOG_INFO, "updating roots (curr:%d, new:%d)", array_size(roots), array_size(new_roots));
 
-  unregister_roots();
-
   if (array_size(new_roots) == 0) {
+    unregister_roots();
     output("UNWATCHEABLE\n#\n");
     array_delete(new_roots);
     return true;
   }
   else if (array_size(new_roots) == 1 && strcmp(array_get(new_roots, 0), "/") == 0) {  // refuse to watch entire tree
+    unregister_roots();
     output("UNWATCHEABLE\n/\n#\n");
     userlog(LOG_INFO, "unwatchable: /");
     array_delete_vs_data(new_roots);
     return true;
   }
 
-  array* mounts = unwatchable_mounts();
-  if (mounts == NULL) {
+  array* added = array_create(20);
+  CHECK_NULL(added, false);
+  if (!diff_roots(new_roots, added)) {
     return false;
   }
+  userlog(LOG_INFO, "roots diff: %d kept, %d added", array_size(roots), array_size(added));
 
   array* unwatchable = array_create(20);
-  if (!register_roots(new_roots, unwatchable, mounts)) {
+  CHECK_NULL(unwatchable, false);
+
+  // paths of removed roots are already dropped from the uncovered list, the main loop reports that
+  int uncovered_before = uncovered_count();
+  if (array_size(added) > 0 && !register_roots(added, unwatchable)) {
+    return false;
+  }
+  if (uncovered_count() > uncovered_before && !rebalance_roots()) {
     return false;
   }
 
   output("UNWATCHEABLE\n");
+  for (int i=0; i<array_size(roots); i++) {
+    watch_root* root = array_get(roots, i);
+    for (int j=0; j<array_size(root->unwatchable); j++) {
+      if (root->mount_ids == NULL || root->mount_ids[j] < 0) {
+        output("%s\n", (char*)array_get(root->unwatchable, j));
+      }
+    }
+  }
   for (int i=0; i<array_size(unwatchable); i++) {
     char* s = array_get(unwatchable, i);
     output("%s\n", s);
@@ -326,25 +835,134 @@ static bool update_roots(array* new_roots) {
   output("#\n");
 
   array_delete_vs_data(unwatchable);
-  array_delete_vs_data(mounts);
-  array_delete_vs_data(new_roots);
+  array_delete_vs_data(added);
 
+  announce_roots();
+  report_unsaved_roots();
   return true;
 }
 
 
+static int compare_strings(const void* p1, const void* p2) {
+  return strcmp(*(char**)p1, *(char**)p2);
+}
+
+static int compare_root_path(const void* key, const void* p) {
+  return strcmp(*(char**)key, *(char**)p);
+}
+
+// Splits current roots into kept and removed ones; removed roots are unregistered, paths which are not
+// watched yet are moved from `new_roots` into `added` (`new_roots` is consumed).
+// Watch trees of roots overlapping with something being added or removed share nodes with it,
+// so such roots are re-registered as well.
+static bool diff_roots(array* new_roots, array* added) {
+  array_sort(new_roots, &compare_strings);
+
+  int n = array_size(roots);
+  bool* kept = calloc(n > 0 ? n : 1, sizeof(bool));
+  CHECK_NULL(kept, false);
+  for (int i=0; i<n; i++) {
+    watch_root* root = array_get(roots, i);
+    kept[i] = array_bsearch(new_roots, &root->path, &compare_root_path) != NULL;
+  }
+
+  array* current = array_create(n > 0 ? n : 1);
+  CHECK_NULL(current, false);
+  for (int i=0; i<n; i++) {
+    watch_root* root = array_get(roots, i);
+    CHECK_NULL(array_push(current, root->path), false);
+  }
+  array_sort(current, &compare_strings);
+
+  for (int i=0; i<array_size(new_roots); i++) {
+    char* new_root = array_get(new_roots, i);
+    char* next_root = array_get(new_roots, i + 1);
+    bool duplicate = next_root != NULL && strcmp(new_root, next_root) == 0;
+    if (!duplicate && array_bsearch(current, &new_root, &compare_root_path) == NULL) {
+      CHECK_NULL(array_push(added, new_root), false);
+    }
+    else {
+      free(new_root);
+    }
+  }
+  array_delete(new_roots);
+  array_delete(current);
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i=0; i<n; i++) {
+      if (!kept[i]) continue;
+      watch_root* root = array_get(roots, i);
+
+      bool overlaps = false;
+      for (int j=0; j<n && !overlaps; j++) {
+        overlaps = !kept[j] && roots_overlap(root->path, ((watch_root*)array_get(roots, j))->path);
+      }
+      for (int j=0; j<array_size(added) && !overlaps; j++) {
+        overlaps = roots_overlap(root->path, array_get(added, j));
+      }
+
+      if (overlaps) {
+        userlog(LOG_INFO, "re-registering overlapping root: %s", root->path);
+        char* copy = strdup(root->path);
+        CHECK_NULL(copy, false);
+        CHECK_NULL(array_push(added, copy), false);
+        kept[i] = false;
+        changed = true;
+      }
+    }
+  }
+
+  array* remaining = array_create(n > 0 ? n : 1);
+  CHECK_NULL(remaining, false);
+  for (int i=0; i<n; i++) {
+    watch_root* root = array_get(roots, i);
+    if (kept[i]) {
+      CHECK_NULL(array_push(remaining, root), false);
+    }
+    else {
+      unregister_root(root);
+    }
+  }
+  array_delete(roots);
+  roots = remaining;
+  free(kept);
+
+  return true;
+}
+
+static bool roots_overlap(const char* root1, const char* root2) {
+  const char* path1 = UNFLATTEN(root1);
+  const char* path2 = UNFLATTEN(root2);
+  return is_parent_path(path1, path2) || is_parent_path(path2, path1);
+}
+
+
 static void unregister_roots() {
   watch_root* root;
   while ((root = array_pop(roots)) != NULL) {
-    userlog(LOG_INFO, "unregistering root: %s", root->path);
-    unwatch(root->id);
-    free(root->path);
-    free(root);
+    unregister_root(root);
   };
 }
 
+static void unregister_root(watch_root* root) {
+  userlog(LOG_INFO, "unregistering root: %s", root->path);
+  if (last_path_root == root) {
+    last_path_root = NULL;
+  }
+  unwatch_root(root);
+  uncovered_remove_under(UNFLATTEN(root->path));
+  if (root->awaited) {
+    sentinel_unwatch(UNFLATTEN(root->path));
+  }
+  array_delete_vs_data(root->unwatchable);
+  free(root->path);
+  free(root);
+}
+
 
-static bool register_roots(array* new_roots, array* unwatchable, array* mounts) {
+static bool register_roots(array* new_roots, array* unwatchable) {
   for (int i=0; i<array_size(new_roots); i++) {
     char* new_root = array_get(new_roots, i);
     char* unflattened = UNFLATTEN(new_root);
@@ -355,41 +973,51 @@ static bool register_roots(array* new_roots, array* unwatchable, array* mounts)
       continue;
     }
 
+    // roots on polled mounts are polled as a whole
+    const char* parent_mount = unwatchable_parent_mount(unflattened);
+    if (parent_mount != NULL && !use_polling) {
+      userlog(LOG_INFO, "watch root '%s' is under mount point '%s' - skipping", unflattened, parent_mount);
+      CHECK_NULL(array_push(unwatchable, strdup(unflattened)), false);
+      continue;
+    }
+
     array* inner_mounts = array_create(5);
     CHECK_NULL(inner_mounts, false);
-
-    bool skip = false;
-    for (int j=0; j<array_size(mounts); j++) {
-      char* mount = array_get(mounts, j);
-      if (is_parent_path(mount, unflattened)) {
-        userlog(LOG_INFO, "watch root '%s' is under mount point '%s' - skipping", unflattened, mount);
-        CHECK_NULL(array_push(unwatchable, strdup(unflattened)), false);
-        skip = true;
-        break;
-      }
-      else if (is_parent_path(unflattened, mount)) {
-        userlog(LOG_INFO, "watch root '%s' contains mount point '%s' - partial watch", unflattened, mount);
-        char* copy = strdup(mount);
-        CHECK_NULL(array_push(unwatchable, copy), false);
-        CHECK_NULL(array_push(inner_mounts, copy), false);
-      }
+    if (parent_mount == NULL && !collect_mounts(unflattened, false, inner_mounts)) {
+      return false;
     }
-    if (skip) {
-      continue;
+    for (int j=0; j<array_size(inner_mounts); j++) {
+      char* mount = array_get(inner_mounts, j);
+      userlog(LOG_INFO, "watch root '%s' contains mount point '%s' - partial watch", unflattened, mount);
+      userlog(LOG_INFO, "unwatchable: %s", mount);
     }
 
-    int id = watch(new_root, inner_mounts);
-    array_delete(inner_mounts);
+    watch_root* root = calloc(1, sizeof(watch_root));
+    CHECK_NULL(root, false);
+    root->key = ++last_root_key;
+    root->path = strdup(new_root);
+    CHECK_NULL(root->path, false);
+    int id = watch_root_path(root, inner_mounts);
 
-    if (id >= 0 || id == ERR_MISSING) {
-      watch_root* root = malloc(sizeof(watch_root));
-      CHECK_NULL(root, false);
+    if (id >= 0 || id == ERR_MISSING || id == ERR_LIMIT) {
+      if (id == ERR_LIMIT && !uncovered_add(UNFLATTEN(root->path))) {
+        return false;
+      }
       root->id = id;
-      root->path = strdup(new_root);
-      CHECK_NULL(root->path, false);
+      root->unwatchable = inner_mounts;
       CHECK_NULL(array_push(roots, root), false);
+      await_root(root);
+      continue;
+    }
+    free(root->path);
+    free(root);
+
+    for (int j=0; j<array_size(inner_mounts); j++) {
+      CHECK_NULL(array_push(unwatchable, array_get(inner_mounts, j)), false);
     }
-    else if (id == ERR_ABORT) {
+    array_delete(inner_mounts);
+
+    if (id == ERR_ABORT) {
       return false;
     }
     else if (id != ERR_IGNORE) {
@@ -402,37 +1030,85 @@ static bool register_roots(array* new_roots, array* unwatchable, array* mounts)
 }
 
 
-static bool is_watchable(const char* fs) {
-  // don't watch special and network filesystems
-  return !(strncmp(fs, "dev", 3) == 0 || strcmp(fs, "proc") == 0 || strcmp(fs, "sysfs") == 0 || strcmp(fs, MNTTYPE_SWAP) == 0 ||
-           (strncmp(fs, "fuse", 4) == 0 && strcmp(fs, "fuseblk") != 0) ||
-           strcmp(fs, "cifs") == 0 || strcmp(fs, MNTTYPE_NFS) == 0);
+// prefers the fanotify backend when enabled, inotify is used for roots it cannot cover;
+// roots on unwatchable mounts and unwatchable mounts inside roots are polled when polling is enabled
+static int watch_root_path(watch_root* root, array* mounts) {
+  int64_t start = now_us();
+  if (use_polling && unwatchable_parent_mount(UNFLATTEN(root->path)) != NULL) {
+    root->backend = BACKEND_POLL;
+    return poll_watch(root->path);
+  }
+
+  int id = ERR_UNSUPPORTED;
+  if (use_fanotify) {
+    id = fanotify_watch(root->path, mounts);
+    if (id == ERR_UNSUPPORTED) {
+      userlog(LOG_INFO, "fanotify cannot watch %s, falling back to inotify", root->path);
+    }
+  }
+  root->backend = (id != ERR_UNSUPPORTED ? BACKEND_FANOTIFY : BACKEND_INOTIFY);
+  if (id == ERR_UNSUPPORTED) {
+    id = watch(root->path, mounts);
+  }
+
+  if (id >= 0 && use_polling) {
+    poll_mounts(root, mounts);
+  }
+  root->walk_time = now_us() - start;
+  return id;
 }
 
-static array* unwatchable_mounts() {
-  FILE* mtab = setmntent(_PATH_MOUNTED, "r");
-  if (mtab == NULL) {
-    userlog(LOG_ERR, "cannot open " _PATH_MOUNTED);
-    return NULL;
+// nested mounts are covered by the outermost one (`mounts` are sorted)
+static void poll_mounts(watch_root* root, array* mounts) {
+  int n = array_size(mounts);
+  free(root->mount_ids);
+  root->mount_ids = NULL;
+  if (n == 0) {
+    return;
   }
 
-  array* mounts = array_create(20);
-  CHECK_NULL(mounts, NULL);
+  root->mount_ids = malloc(sizeof(int) * n);
+  if (root->mount_ids == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    return;
+  }
+  for (int j=0; j<n; j++) {
+    char* mount = array_get(mounts, j);
+    int k = j - 1;
+    while (k >= 0 && !is_parent_path(array_get(mounts, k), mount)) k--;
+    root->mount_ids[j] = (k >= 0 ? root->mount_ids[k] : poll_watch(mount));
+  }
+}
 
-  struct mntent* ent;
-  while ((ent = getmntent(mtab)) != NULL) {
-    userlog(LOG_DEBUG, "mtab: %s : %s", ent->mnt_dir, ent->mnt_type);
-    if (strcmp(ent->mnt_type, MNTTYPE_IGNORE) != 0 && !is_watchable(ent->mnt_type)) {
-      CHECK_NULL(array_push(mounts, strdup(ent->mnt_dir)), NULL);
-    }
+static void unwatch_root(watch_root* root) {
+  switch (root->backend) {
+    case BACKEND_FANOTIFY:  fanotify_unwatch(root->id); break;
+    case BACKEND_POLL:  poll_unwatch(root->id); break;
+    default:  unwatch(root->id); break;
   }
 
-  endmntent(mtab);
-  return mounts;
+  if (root->mount_ids != NULL) {
+    for (int j=0; j<array_size(root->unwatchable); j++) {
+      if (root->mount_ids[j] >= 0) {
+        poll_unwatch(root->mount_ids[j]);
+      }
+    }
+    free(root->mount_ids);
+    root->mount_ids = NULL;
+  }
 }
 
 
 static void inotify_callback(const char* path, int event) {
+  if (event & IN_Q_OVERFLOW) {
+    overflow_count++;
+    recover_from_overflow(path);
+    return;
+  }
+
+  uint64_t trace_start = TRACE_START();
+  PROBE2(callback__start, path, event);
+
   if (event & (IN_CREATE | IN_MOVED_TO)) {
     report_event("CREATE", path);
     report_event("CHANGE", path);
@@ -453,35 +1129,195 @@ static void inotify_callback(const char* path, int event) {
     output("RESET\n");
     userlog(LOG_DEBUG, "RESET");
   }
+
+  PROBE(callback__done);
+  TRACE_END(TRACE_CALLBACK, trace_start);
+}
+
+// a rename inside watched trees (the watches have followed it already)
+static void move_callback(const char* from, const char* to, bool is_dir) {
+  if (is_dir) {
+    uncovered_move(from, to);
+  }
+
+  if (features & FEATURE_MOVE) {
+    userlog(LOG_DEBUG, "MOVE: %s -> %s", from, to);
+    events_emitted++;
+    if (features & FEATURE_BINARY) {
+      report_record(BIN_MOVE_FROM, from);
+      report_record(BIN_MOVE_TO, to);
+    }
+    else {
+      output_line("MOVE");
+      output_line(from);
+      output_line(to);
+    }
+    if (output_len >= OUTPUT_FLUSH_THRESHOLD) {
+      flush_output();
+    }
+  }
+  else {
+    report_event("DELETE", from);
+    report_event("CREATE", to);
+    report_event("CHANGE", to);
+  }
 }
 
 static void report_event(const char* event, const char* path) {
   userlog(LOG_DEBUG, "%s: %s", event, path);
 
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wincompatible-pointer-types"
-  char* copy = path, *p;
-  for (p = copy; *p != '\0'; ++p) {
-    if (*p == '\n') {
-      if (copy == path) {
-        copy = strdup(path);
-        p = copy + (p - path);
-      }
-      *p = '\0';
+  if (features & FEATURE_BINARY) {
+    int type = (strcmp(event, "CREATE") == 0 ? BIN_CREATE :
+                strcmp(event, "CHANGE") == 0 ? BIN_CHANGE :
+                strcmp(event, "STATS") == 0 ? BIN_STATS :
+                strcmp(event, "DELETE") == 0 ? BIN_DELETE :
+                strcmp(event, "RECDIRTY") == 0 ? BIN_RECDIRTY : BIN_DIRTY);
+    if (report_record(type, path)) {
+      events_emitted++;
     }
   }
-#pragma clang diagnostic pop
+  else {
+    events_emitted++;
+    output_line(event);
+    output_line(path);
+  }
 
-  fputs(event, stdout);
-  fputc('\n', stdout);
-  fwrite(copy, (p - copy), 1, stdout);
-  fputc('\n', stdout);
+  if (output_len >= OUTPUT_FLUSH_THRESHOLD) {
+    flush_output();
+  }
+}
 
-  if (copy != path) {
-    free(copy);
+static void put_le(char* p, uint64_t value, int bytes) {
+  for (int i=0; i<bytes; i++) {
+    p[i] = (char)(value >> (8 * i));
   }
+}
 
-  fflush(stdout);
+// some root containing the path (any one will do, the client only prepends its path); NULL when there is none
+static watch_root* path_root(const char* path) {
+  watch_root* root = last_path_root;
+  for (int i=-1; i<array_size(roots); i++) {
+    if (i >= 0) {
+      root = array_get(roots, i);
+    }
+    if (root == NULL) {
+      continue;
+    }
+    const char* root_path = UNFLATTEN(root->path);
+    size_t len = strlen(root_path);
+    if (strncmp(root_path, path, len) == 0 && (path[len] == '\0' || path[len] == '/')) {
+      last_path_root = root;
+      return root;
+    }
+  }
+  return NULL;
+}
+
+static void output_record(int type, uint32_t key, const char* path, size_t path_len) {
+  bool timestamp = (features & FEATURE_TIMESTAMPS) != 0;
+  size_t len = BIN_HEADER_LEN + (timestamp ? 8 : 0) + path_len;
+  if (path_len > UINT16_MAX || !output_reserve(len)) {
+    return;
+  }
+
+  char* p = output_buf + output_len;
+  p[0] = (char)type;
+  p[1] = (char)(timestamp ? BIN_FLAG_TIMESTAMP : 0);
+  put_le(p + 2, path_len, 2);
+  put_le(p + 4, key, 4);
+  p += BIN_HEADER_LEN;
+  if (timestamp) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    put_le(p, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, 8);
+    p += 8;
+  }
+  memcpy(p, path, path_len);
+  output_len += len;
+  text_record = SIZE_MAX;
+}
+
+// an event as a binary record; a CHANGE right after the CREATE of the same path is dropped
+// returns false when the record is not written (a CHANGE implied by the preceding CREATE is dropped)
+static bool report_record(int type, const char* path) {
+  watch_root* root = path_root(path);
+  uint32_t key = 0;
+  if (root != NULL) {
+    size_t len = strlen(UNFLATTEN(root->path));
+    path += (path[len] == '/' ? len + 1 : len);
+    key = root->key;
+  }
+  size_t path_len = strlen(path);
+
+  if (type == BIN_CHANGE && create_record != SIZE_MAX) {
+    const char* created = output_buf + create_record;
+    size_t offset = BIN_HEADER_LEN + ((created[1] & BIN_FLAG_TIMESTAMP) ? 8 : 0);
+    uint32_t created_key = (uint8_t)created[4] | (uint8_t)created[5] << 8 | (uint8_t)created[6] << 16 | (uint32_t)(uint8_t)created[7] << 24;
+    size_t created_len = (uint8_t)created[2] | (uint8_t)created[3] << 8;
+    if (created_key == key && created_len == path_len && memcmp(created + offset, path, path_len) == 0) {
+      create_record = SIZE_MAX;
+      records_coalesced++;
+      return false;
+    }
+  }
+
+  size_t offset = output_len;
+  output_record(type, key, path, path_len);
+  create_record = (type == BIN_CREATE && output_len > offset ? offset : SIZE_MAX);
+  return output_len > offset;
+}
+
+// binary records of roots the client has not been told about yet
+static void announce_roots() {
+  if (!(features & FEATURE_BINARY)) {
+    return;
+  }
+  for (int i=0; i<array_size(roots); i++) {
+    watch_root* root = array_get(roots, i);
+    if (!root->announced) {
+      const char* path = UNFLATTEN(root->path);
+      output_record(BIN_ROOT, root->key, path, strlen(path));
+      root->announced = true;
+    }
+  }
+  create_record = SIZE_MAX;
+}
+
+// a line of output; line breaks within paths are sent as zero bytes
+static void output_line(const char* path) {
+  size_t path_len = strlen(path);
+  if (!begin_text() || !output_reserve(path_len + 1)) {
+    return;
+  }
+
+  char* p = output_buf + output_len;
+  for (size_t i=0; i<path_len; i++) {
+    *p++ = (path[i] == '\n' ? '\0' : path[i]);
+  }
+  *p++ = '\n';
+  output_len = p - output_buf;
+  end_text();
+}
+
+// in the binary protocol, text goes into a TEXT record (the last one is extended while nothing else follows it)
+static bool begin_text() {
+  if (!(features & FEATURE_BINARY) || text_record != SIZE_MAX) {
+    return true;
+  }
+  if (!output_reserve(BIN_HEADER_LEN)) {
+    return false;
+  }
+  memset(output_buf + output_len, 0, BIN_HEADER_LEN);
+  text_record = output_len;
+  output_len += BIN_HEADER_LEN;
+  create_record = SIZE_MAX;
+  return true;
+}
+
+static void end_text() {
+  if ((features & FEATURE_BINARY) && text_record != SIZE_MAX) {
+    put_le(output_buf + text_record + 4, output_len - text_record - BIN_HEADER_LEN, 4);
+  }
 }
 
 
@@ -492,24 +1328,133 @@ static void output(const char* format, ...) {
 
   va_list ap;
   va_start(ap, format);
-  vprintf(format, ap);
+  int len = vsnprintf(NULL, 0, format, ap);
+  va_end(ap);
+
+  if (len < 0 || !begin_text() || !output_reserve(len + 1)) {
+    return;
+  }
+
+  va_start(ap, format);
+  vsnprintf(output_buf + output_len, len + 1, format, ap);
   va_end(ap);
+  output_len += len;
+  end_text();
+}
+
+// makes room for at least `len` more bytes in the output buffer
+static bool output_reserve(size_t len) {
+  if (output_len + len <= output_cap) {
+    return true;
+  }
+
+  size_t new_cap = (output_cap > 0 ? output_cap : OUTPUT_BUF_LEN);
+  while (new_cap < output_len + len) {
+    new_cap *= 2;
+  }
+
+  char* new_buf = realloc(output_buf, new_cap);
+  if (new_buf == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    return false;
+  }
+  output_buf = new_buf;
+  output_cap = new_cap;
+  return true;
+}
+
+// sends everything collected so far to the client in a single write (short writes permitting)
+static void flush_output() {
+  if (output_len == 0) {
+    return;
+  }
+
+  if (self_test) {
+    fflush(stdout);
+  }
+
+  uint64_t trace_start = TRACE_START();
+  PROBE1(write__start, output_len);
+  size_t written = 0;
+  while (written < output_len) {
+    ssize_t n = write(STDOUT_FILENO, output_buf + written, output_len - written);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      userlog(LOG_ERR, "write: %s", strerror(errno));
+      break;
+    }
+    written += n;
+    bytes_written += n;
+  }
+  PROBE1(write__done, written);
+  TRACE_END(TRACE_WRITE, trace_start);
 
-  fflush(stdout);
+  output_len = 0;
+  text_record = create_record = SIZE_MAX;
 }
 
 
+// the fallback for missing roots which cannot be awaited by a sentinel (e.g. on network mounts)
 static void check_missing_roots() {
   struct stat st;
   for (int i=0; i<array_size(roots); i++) {
     watch_root* root = array_get(roots, i);
-    if (root->id < 0) {
-      char* unflattened = UNFLATTEN(root->path);
-      if (stat(unflattened, &st) == 0) {
-        root->id = watch(root->path, NULL);
-        userlog(LOG_INFO, "root restored: %s\n", root->path);
-        report_event("CREATE", unflattened);
-        report_event("CHANGE", unflattened);
+    if (root->id < 0 && root->id != ERR_LIMIT && !root->awaited && stat(UNFLATTEN(root->path), &st) == 0) {
+      restore_root(root);
+    }
+  }
+}
+
+// On a warm start, walks of the first roots report changes made since the previous run; roots that run
+// did not know are rescanned by the client. The saved snapshot is of no use afterwards.
+static void report_unsaved_roots() {
+  if (!snapshot_has_saved()) {
+    return;
+  }
+  for (int i=0; i<array_size(roots); i++) {
+    watch_root* root = array_get(roots, i);
+    char* unflattened = UNFLATTEN(root->path);
+    if (root->id >= 0 && !snapshot_saved(unflattened)) {
+      report_event(unflattened == root->path ? "RECDIRTY" : "DIRTY", unflattened);
+    }
+  }
+  snapshot_release_saved();
+}
+
+static void restore_root(watch_root* root) {
+  char* unflattened = UNFLATTEN(root->path);
+  root->id = watch_root_path(root, root->unwatchable);
+  if (root->id == ERR_LIMIT) {
+    uncovered_add(unflattened);
+  }
+  userlog(LOG_INFO, "root restored: %s (%d)", root->path, root->id);
+  report_event("CREATE", unflattened);
+  report_event("CHANGE", unflattened);
+  if (root->id == ERR_MISSING) {
+    await_root(root);  // gone again
+  }
+}
+
+// sentinels only see local changes, so roots on unwatchable mounts are left to check_missing_roots()
+static void await_root(watch_root* root) {
+  root->awaited = false;
+  if (root->id >= 0 || root->id == ERR_LIMIT || unwatchable_parent_mount(UNFLATTEN(root->path)) != NULL) {
+    return;
+  }
+  // the path may be there already, the callback then restores the root before this returns
+  root->awaited = true;
+  if (!sentinel_watch(UNFLATTEN(root->path))) {
+    root->awaited = false;
+  }
+}
+
+static void sentinel_callback(const char* path, bool appeared) {
+  for (int i=0; i<array_size(roots); i++) {
+    watch_root* root = array_get(roots, i);
+    if (root->awaited && strcmp(path, UNFLATTEN(root->path)) == 0) {
+      root->awaited = false;
+      if (appeared) {
+        restore_root(root);
       }
     }
   }
@@ -519,10 +1464,244 @@ static void check_root_removal(const char* path) {
   for (int i=0; i<array_size(roots); i++) {
     watch_root* root = array_get(roots, i);
     if (root->id >= 0 && strcmp(path, UNFLATTEN(root->path)) == 0) {
-      unwatch(root->id);
+      unwatch_root(root);
       root->id = -1;
       userlog(LOG_INFO, "root deleted: %s\n", root->path);
       report_event("DELETE", path);
+      await_root(root);
     }
   }
 }
+
+// Events were lost (for the given root, or for all of them when the path is empty): re-walks roots,
+// picking up directories created meanwhile and dropping the vanished ones, then asks the client to rescan just these roots.
+static void recover_from_overflow(const char* path) {
+  userlog(LOG_INFO, "recovering from lost events: %s", path);
+
+  for (int i=0; i<array_size(roots); i++) {
+    watch_root* root = array_get(roots, i);
+    char* unflattened = UNFLATTEN(root->path);
+    if (root->id < 0 || (path[0] != '\0' && strcmp(path, unflattened) != 0)) {
+      continue;
+    }
+
+    if (root->backend == BACKEND_POLL) {
+      continue;
+    }
+    if (root->backend == BACKEND_FANOTIFY) {
+      // filesystem marks survive an overflow, there is nothing to re-walk
+      report_event(unflattened == root->path ? "RECDIRTY" : "DIRTY", unflattened);
+      continue;
+    }
+
+    if (rewatch_root(root)) {
+      if (use_snapshots && unflattened == root->path) {
+        snapshot_report(&report_event);  // the walk has compared directories to their listings
+      }
+      else {
+        report_event(unflattened == root->path ? "RECDIRTY" : "DIRTY", unflattened);
+      }
+    }
+  }
+}
+
+// walks the root again, reconciling its watch tree with the disk; a root which is gone is reported deleted
+static bool rewatch_root(watch_root* root) {
+  int64_t start = now_us();
+  int id = watch(root->path, root->unwatchable);
+  root->walk_time = now_us() - start;
+  if (id < 0) {
+    userlog(LOG_INFO, "root lost on rescan: %s (%d)", root->path, id);
+    unwatch(root->id);
+    root->id = -1;
+    report_event("DELETE", UNFLATTEN(root->path));
+    await_root(root);
+    return false;
+  }
+
+  root->id = id;
+  return true;
+}
+
+
+// Spends the watch budget on roots by priority: inotify watches are dropped and the roots are walked again,
+// best directories first. Roots which were watched before are rescanned by the client, as events are lost meanwhile.
+static bool rebalance_roots() {
+  int n = array_size(roots);
+  bool* watched = malloc((n > 0 ? n : 1) * sizeof(bool));
+  int* ids = malloc((n > 0 ? n : 1) * sizeof(int));
+  array* paths = array_create(n > 0 ? n : 1);
+  array* mounts = array_create(n > 0 ? n : 1);
+
+  // everything that may fail is done before the roots are unwatched
+  bool ready = watched != NULL && ids != NULL && paths != NULL && mounts != NULL;
+  for (int i=0; i<n && ready; i++) {
+    watch_root* root = array_get(roots, i);
+    watched[i] = root->id >= 0;
+    if (root->backend == BACKEND_INOTIFY && UNFLATTEN(root->path) == root->path) {
+      ready = array_push(paths, root->path) != NULL && array_push(mounts, root->unwatchable) != NULL;
+    }
+  }
+  if (!ready) {
+    userlog(LOG_ERR, "out of memory");
+    free(watched);
+    free(ids);
+    array_delete(paths);
+    array_delete(mounts);
+    return false;
+  }
+
+  for (int i=0; i<n; i++) {
+    watch_root* root = array_get(roots, i);
+    if (root->backend == BACKEND_INOTIFY && root->id >= 0) {
+      unwatch(root->id);
+    }
+  }
+  uncovered_clear();
+
+  int budget = watch_budget(get_watch_usage());
+  userlog(LOG_INFO, "rebalancing %d roots, budget %d", n, budget);
+
+  // flat roots cost a single watch each and go first
+  for (int i=0; i<n; i++) {
+    watch_root* root = array_get(roots, i);
+    if (root->backend == BACKEND_INOTIFY && UNFLATTEN(root->path) != root->path) {
+      root->id = watch(root->path, root->unwatchable);
+    }
+  }
+
+  bool result = watch_prioritized(paths, mounts, NULL, ids, budget);
+
+  for (int i=0, j=0; i<n; i++) {
+    watch_root* root = array_get(roots, i);
+    if (root->backend != BACKEND_INOTIFY) continue;
+    if (UNFLATTEN(root->path) == root->path) {
+      root->id = ids[j++];
+    }
+    if (root->id < 0 && root->id != ERR_LIMIT) {
+      root->id = -1;
+    }
+    else if (root->id >= 0 && watched[i]) {
+      report_event(UNFLATTEN(root->path) == root->path ? "RECDIRTY" : "DIRTY", UNFLATTEN(root->path));
+    }
+  }
+
+  free(watched);
+  free(ids);
+  array_delete(paths);
+  array_delete(mounts);
+  return result;
+}
+
+static void report_uncovered() {
+  output("UNCOVERED\n");
+  for (int i=0; i<uncovered_count(); i++) {
+    output("%s\n", uncovered_get(i));
+  }
+  output("#\n");
+}
+
+// Uncovered directories are polled at a low rate when polling is enabled (see poll_uncovered()); a budget
+// which has grown enough (e.g. another instance has exited) is spent on them, below the watched trees.
+// Small changes, as made by other instances all the time, are ignored: the usage scan and the walk
+// are not worth a handful of watches.
+static void check_uncovered() {
+  if (uncovered_count() == 0 || ++poll_ticks < UNCOVERED_POLL_TICKS) {
+    return;
+  }
+  poll_ticks = 0;
+
+  int usage = get_watch_usage();
+  int budget = watch_budget(usage);
+  int threshold = budget / BUDGET_GROWTH_SHARE;
+  if (budget - usage >= (threshold > MIN_BUDGET_GROWTH ? threshold : MIN_BUDGET_GROWTH)) {
+    watch_uncovered(budget);
+  }
+  else {
+    drop_gone_uncovered();
+  }
+}
+
+// Walks uncovered directories best first, attaching them to the watched trees, which are kept as they are.
+// The client rescans just the directories which got watched (their subtrees were only polled so far).
+static bool watch_uncovered(int budget) {
+  int n = uncovered_count();
+  array* paths = array_create(n > 0 ? n : 1);
+  array* mounts = array_create(n > 0 ? n : 1);
+  array* owners = array_create(n > 0 ? n : 1);
+  array* kept = array_create(16);  // uncovered directories which cannot be attached yet
+  int* parents = malloc((n > 0 ? n : 1) * sizeof(int));
+  int* ids = malloc((n > 0 ? n : 1) * sizeof(int));
+  bool result = paths != NULL && mounts != NULL && owners != NULL && kept != NULL && parents != NULL && ids != NULL;
+
+  for (int i=0; i<n && result; i++) {
+    const char* path = uncovered_get(i);
+    watch_root* owner = NULL;
+    for (int j=0; j<array_size(roots) && owner == NULL; j++) {
+      watch_root* root = array_get(roots, j);
+      if (root->backend == BACKEND_INOTIFY && root->path[0] != '|' && (root->id >= 0 || root->id == ERR_LIMIT) &&
+          is_parent_path(root->path, path)) {
+        owner = root;
+      }
+    }
+    int parent = -1;
+    if (owner != NULL && strcmp(owner->path, path) != 0) {
+      char* parent_path = strndup(path, strrchr(path, '/') - path);
+      if (parent_path == NULL) {
+        result = false;
+        break;
+      }
+      parent = (owner->id >= 0 ? get_watch_id(owner->id, parent_path) : -1);
+      free(parent_path);
+      if (parent < 0) {
+        owner = NULL;
+      }
+    }
+
+    char* copy = strdup(path);
+    if (copy == NULL || array_push(owner != NULL ? paths : kept, copy) == NULL) {
+      free(copy);
+      result = false;
+    }
+    else if (owner != NULL) {
+      parents[array_size(paths) - 1] = parent;
+      result = array_push(mounts, owner->unwatchable) != NULL && array_push(owners, owner) != NULL;
+    }
+  }
+
+  if (result) {
+    userlog(LOG_INFO, "watching %d of %d uncovered directories, budget %d", array_size(paths), n, budget);
+    uncovered_clear();
+    for (int i=0; i<array_size(kept); i++) {
+      uncovered_add(array_get(kept, i));
+    }
+    result = watch_prioritized(paths, mounts, parents, ids, budget);
+
+    for (int i=0; i<array_size(paths); i++) {
+      watch_root* owner = array_get(owners, i);
+      if (parents[i] < 0) {
+        owner->id = (ids[i] >= 0 || ids[i] == ERR_LIMIT ? ids[i] : -1);
+      }
+      if (ids[i] >= 0) {
+        report_event("RECDIRTY", array_get(paths, i));
+      }
+    }
+  }
+  else {
+    userlog(LOG_ERR, "out of memory");
+  }
+
+  array_delete_vs_data(paths);
+  array_delete(mounts);
+  array_delete(owners);
+  array_delete_vs_data(kept);
+  free(parents);
+  free(ids);
+  return result;
+}
+
+static int64_t now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
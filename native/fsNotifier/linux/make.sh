@@ -1,16 +1,20 @@
 #!/bin/sh
 
-CC_FLAGS="-O2 -Wall -Wextra -Wpedantic -std=c11 -D_DEFAULT_SOURCE"
+CC_FLAGS="-O2 -Wall -Wextra -Wpedantic -std=c11 -D_DEFAULT_SOURCE -pthread"
+
+if [ -f "/usr/include/sys/sdt.h" ] ; then
+  CC_FLAGS="${CC_FLAGS} -DHAVE_SDT"
+fi
 
 VER=$(date "+%Y%m%d.%H%M")
 sed -i.bak "s/#define VERSION .*/#define VERSION \"${VER}\"/" fsnotifier.h && rm fsnotifier.h.bak
 
 if [ -f "/usr/include/gnu/stubs-32.h" ] ; then
   echo "compiling 32-bit version"
-  clang -m32 ${CC_FLAGS} -o fsnotifier main.c inotify.c util.c && chmod 755 fsnotifier
+  clang -m32 ${CC_FLAGS} -o fsnotifier main.c inotify.c fanotify.c mounts.c exclude.c budget.c poll.c sentinel.c sim.c snapshot.c record.c pool.c trace.c util.c && chmod 755 fsnotifier
 fi
 
 if [ -f "/usr/include/gnu/stubs-64.h" ] ; then
   echo "compiling 64-bit version"
-  clang -m64 ${CC_FLAGS} -o fsnotifier64 main.c inotify.c util.c && chmod 755 fsnotifier64
+  clang -m64 ${CC_FLAGS} -o fsnotifier64 main.c inotify.c fanotify.c mounts.c exclude.c budget.c poll.c sentinel.c sim.c snapshot.c record.c pool.c trace.c util.c && chmod 755 fsnotifier64
 fi
\ No newline at end of file
@@ -0,0 +1,257 @@
+/*
+ * Copyright 2000-2016 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <mntent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define MOUNTINFO_PATH "/proc/self/mountinfo"
+
+// Mount points sorted by path, so that all mounts under a given directory form a contiguous range
+// and the ones above it are found by looking up each ancestor. The table is re-read only after
+// the kernel reports a change (POLLPRI on mountinfo).
+
+typedef struct {
+  char* path;
+  bool watchable;
+} mount_entry;
+
+static array* mounts = NULL;
+static bool stale = true;
+static int mountinfo_fd = -1;
+
+
+static bool is_watchable(const char* fs) {
+  // don't watch special and network filesystems
+  return !(strncmp(fs, "dev", 3) == 0 || strcmp(fs, "proc") == 0 || strcmp(fs, "sysfs") == 0 || strcmp(fs, MNTTYPE_SWAP) == 0 ||
+           (strncmp(fs, "fuse", 4) == 0 && strcmp(fs, "fuseblk") != 0) ||
+           strcmp(fs, "cifs") == 0 || strcmp(fs, MNTTYPE_NFS) == 0);
+}
+
+// mountinfo escapes blanks and backslashes as octal sequences
+static void unescape(char* s) {
+  char* p = s;
+  while (*s != '\0') {
+    if (s[0] == '\\' && s[1] >= '0' && s[1] <= '7' && s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+      *p++ = (char)(((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0'));
+      s += 4;
+    }
+    else {
+      *p++ = *s++;
+    }
+  }
+  *p = '\0';
+}
+
+// "id parent major:minor root mount_point options [optional fields] - fs_type source super_options"
+static bool parse_mountinfo_line(char* line, char** mount_point, char** fs_type) {
+  char* saveptr = NULL;
+  char* field = strtok_r(line, " ", &saveptr);
+  for (int i=0; field != NULL && i<4; i++) {
+    field = strtok_r(NULL, " ", &saveptr);
+  }
+  if (field == NULL) {
+    return false;
+  }
+  *mount_point = field;
+
+  while ((field = strtok_r(NULL, " ", &saveptr)) != NULL && strcmp(field, "-") != 0) ;
+  if (field == NULL || (field = strtok_r(NULL, " ", &saveptr)) == NULL) {
+    return false;
+  }
+  *fs_type = field;
+
+  unescape(*mount_point);
+  return true;
+}
+
+static int compare_entries(const void* p1, const void* p2) {
+  return strcmp((*(mount_entry**)p1)->path, (*(mount_entry**)p2)->path);
+}
+
+static void delete_mounts() {
+  for (int i=0; i<array_size(mounts); i++) {
+    mount_entry* entry = array_get(mounts, i);
+    free(entry->path);
+    free(entry);
+  }
+  array_delete(mounts);
+  mounts = NULL;
+}
+
+static bool load_mounts() {
+  FILE* f = fopen(MOUNTINFO_PATH, "re");
+  if (f == NULL) {
+    userlog(LOG_ERR, "cannot open " MOUNTINFO_PATH ": %s", strerror(errno));
+    return false;
+  }
+
+  delete_mounts();
+  mounts = array_create(64);
+  if (mounts == NULL) {
+    fclose(f);
+    userlog(LOG_ERR, "out of memory");
+    return false;
+  }
+
+  bool result = true;
+  char* line = NULL;
+  size_t line_cap = 0;
+  while (getline(&line, &line_cap, f) > 0) {
+    line[strcspn(line, "\n")] = '\0';
+    char *mount_point, *fs_type;
+    if (!parse_mountinfo_line(line, &mount_point, &fs_type)) {
+      continue;
+    }
+    userlog(LOG_DEBUG, "mountinfo: %s : %s", mount_point, fs_type);
+
+    mount_entry* entry = malloc(sizeof(mount_entry));
+    char* path = strdup(mount_point);
+    if (entry == NULL || path == NULL || array_push(mounts, entry) == NULL) {
+      free(entry);
+      free(path);
+      userlog(LOG_ERR, "out of memory");
+      result = false;
+      break;
+    }
+    entry->path = path;
+    entry->watchable = is_watchable(fs_type);
+  }
+  free(line);
+  fclose(f);
+
+  // stacked mounts leave duplicates, the remaining one is unwatchable if any of them is
+  array_sort(mounts, &compare_entries);
+  int n = 0;
+  for (int i=0; i<array_size(mounts); i++) {
+    mount_entry* entry = array_get(mounts, i);
+    mount_entry* next = array_get(mounts, i + 1);
+    if (next != NULL && strcmp(entry->path, next->path) == 0) {
+      next->watchable = next->watchable && entry->watchable;
+      free(entry->path);
+      free(entry);
+    }
+    else {
+      array_put(mounts, n++, entry);
+    }
+  }
+  while (array_size(mounts) > n) {
+    array_pop(mounts);
+  }
+
+  userlog(LOG_INFO, "mount table: %d entries", n);
+  stale = !result;
+  return result;
+}
+
+static bool ensure_mounts() {
+  return !stale || load_mounts();
+}
+
+// index of the first entry not less than `path`
+static int lower_bound(const char* path) {
+  int lo = 0, hi = array_size(mounts);
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (strcmp(((mount_entry*)array_get(mounts, mid))->path, path) < 0) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static mount_entry* find_mount(const char* path, int len) {
+  char key[len + 1];
+  memcpy(key, path, len);
+  key[len] = '\0';
+  int i = lower_bound(key);
+  mount_entry* entry = array_get(mounts, i);
+  return (entry != NULL && strcmp(entry->path, key) == 0 ? entry : NULL);
+}
+
+
+// the table is loaded on first use, so an unreadable one only fails the ROOTS requests that need it
+void init_mount_table() {
+  mountinfo_fd = open(MOUNTINFO_PATH, O_RDONLY | O_CLOEXEC);
+  if (mountinfo_fd < 0) {
+    userlog(LOG_WARNING, "cannot open " MOUNTINFO_PATH ": %s", strerror(errno));
+  }
+  stale = true;
+}
+
+int get_mount_table_fd() {
+  return mountinfo_fd;
+}
+
+void mount_table_changed() {
+  userlog(LOG_DEBUG, "mount table changed");
+  stale = true;
+}
+
+const char* unwatchable_parent_mount(const char* path) {
+  if (!ensure_mounts()) {
+    return NULL;
+  }
+
+  // ancestors are looked up the same way is_parent_path() matches them, the path itself included
+  int len = strlen(path);
+  for (int i=len; i>0; i--) {
+    if (i == len || path[i] == '/') {
+      mount_entry* entry = find_mount(path, i);
+      if (entry != NULL && !entry->watchable) {
+        return entry->path;
+      }
+    }
+  }
+  return NULL;
+}
+
+bool collect_mounts(const char* path, bool watchable, array* result) {
+  if (!ensure_mounts()) {
+    return false;
+  }
+
+  for (int i=lower_bound(path); i<array_size(mounts); i++) {
+    mount_entry* entry = array_get(mounts, i);
+    if (strncmp(entry->path, path, strlen(path)) != 0) {
+      break;
+    }
+    if (entry->watchable == watchable && strcmp(entry->path, path) != 0 && is_parent_path(path, entry->path)) {
+      char* copy = strdup(entry->path);
+      CHECK_NULL(copy, false);
+      CHECK_NULL(array_push(result, copy), false);
+    }
+  }
+  return true;
+}
+
+void close_mount_table() {
+  delete_mounts();
+  stale = true;
+  if (mountinfo_fd >= 0) {
+    close(mountinfo_fd);
+    mountinfo_fd = -1;
+  }
+}
@@ -0,0 +1,686 @@
+/*
+ * Copyright 2000-2016 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE  // statx()
+
+#include "fsnotifier.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_POLL_THREADS 4
+#define MAX_POLL_THREADS 32
+
+#define MIN_POLL_INTERVAL 2000
+#define MAX_POLL_INTERVAL 30000
+#define UNCOVERED_POLL_INTERVAL 15000
+
+// Mounts which cannot be watched are polled by a background thread, one root at a time.
+// Every directory keeps a sorted snapshot of its entries (type, size, mtime, ctime); the listing is re-read
+// only when the directory's own mtime moves, otherwise just the known entries are stat'ed again.
+// Directories of a round are spread over a small pool, which bounds the number of requests in flight.
+// A root is polled more often while it changes and backs off while it is quiet; directories left uncovered
+// by the watch budget (see budget.c) are polled the same way, only at a lower rate.
+// Events are queued for the main thread (see process_poll_input()) and reported as inotify masks.
+
+typedef struct {
+  int64_t mtime;
+  int64_t ctime;
+  int64_t size;
+  bool dir;
+} file_state;
+
+typedef struct poll_dir poll_dir;
+typedef struct poll_root poll_root;
+
+typedef struct {
+  char* name;
+  file_state state;
+  poll_dir* sub;  // subdirectories of recursive roots
+} poll_entry;
+
+struct poll_dir {
+  poll_root* root;
+  int64_t mtime;
+  poll_entry* entries;
+  int count;
+  bool fresh;  // not read yet: entries are taken without reporting
+  int path_len;
+  char path[];
+};
+
+struct poll_root {
+  int id;
+  bool recursive;
+  bool busy;     // a round is in progress, the root is only freed afterwards
+  bool removed;
+  bool reset;    // snapshots are to be taken anew
+  poll_dir* top;       // NULL for a file root
+  file_state file;
+  int interval;
+  int min_interval;
+  int64_t due;
+  atomic_int changes;
+  char path[];
+};
+
+typedef struct {
+  int id;
+  int mask;
+  char path[];
+} poll_event;
+
+static pthread_mutex_t poll_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poll_wakeup;
+static pthread_t poll_thread;
+static bool poll_started = false;
+static bool stopping = false;
+static array* roots = NULL;
+static int next_id = 0;
+static pool* poll_pool = NULL;
+static int event_fd = -1;
+static void (* callback)(const char*, int) = NULL;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static array* queue = NULL;
+
+static void* poll_main(void* arg);
+static void free_poll_dir(poll_dir* dir);
+
+
+static int poll_threads = 0;
+
+// the thread and the pool are only started with the first polled root (see start_polling())
+bool init_polling() {
+  int threads = DEFAULT_POLL_THREADS;
+  char* env_threads = getenv(POLL_THREADS_ENV);
+  if (env_threads != NULL) {
+    threads = atoi(env_threads);
+    if (threads > MAX_POLL_THREADS) {
+      threads = MAX_POLL_THREADS;
+    }
+  }
+  if (threads <= 0) {
+    userlog(LOG_INFO, "polling is disabled");
+    return false;
+  }
+  poll_threads = threads;
+
+  roots = array_create(8);
+  queue = array_create(64);
+  CHECK_NULL(roots, false);
+  CHECK_NULL(queue, false);
+
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd < 0) {
+    userlog(LOG_ERR, "eventfd: %s", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+static bool start_polling() {
+  if (poll_started) {
+    return true;
+  }
+
+  if (poll_pool == NULL) {
+    poll_pool = pool_create(poll_threads);
+    CHECK_NULL(poll_pool, false);
+  }
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&poll_wakeup, &attr);
+  pthread_condattr_destroy(&attr);
+
+  int rc = pthread_create(&poll_thread, NULL, &poll_main, NULL);
+  if (rc != 0) {
+    userlog(LOG_ERR, "pthread_create: %s", strerror(rc));
+    pthread_cond_destroy(&poll_wakeup);
+    return false;
+  }
+  poll_started = true;
+
+  userlog(LOG_INFO, "poll threads: %d", pool_size(poll_pool));
+  return true;
+}
+
+void set_poll_callback(void (* _callback)(const char*, int)) {
+  callback = _callback;
+}
+
+int get_poll_fd() {
+  return event_fd;
+}
+
+
+static int64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// `name` is relative to `fd`; an empty name stands for the descriptor itself
+static bool read_state(int fd, const char* name, file_state* state) {
+  int flags = AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | (name[0] == '\0' ? AT_EMPTY_PATH : 0);
+#ifdef STATX_BASIC_STATS
+  struct statx st;
+  if (statx(fd, name, flags, STATX_TYPE | STATX_MTIME | STATX_CTIME | STATX_SIZE, &st) != 0) {
+    return false;
+  }
+  state->mtime = (int64_t)st.stx_mtime.tv_sec * 1000000000 + st.stx_mtime.tv_nsec;
+  state->ctime = (int64_t)st.stx_ctime.tv_sec * 1000000000 + st.stx_ctime.tv_nsec;
+  state->size = (int64_t)st.stx_size;
+  state->dir = S_ISDIR(st.stx_mode);
+#else
+  struct stat st;
+  if (fstatat(fd, name, &st, flags) != 0) {
+    return false;
+  }
+  state->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  state->ctime = (int64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+  state->size = (int64_t)st.st_size;
+  state->dir = S_ISDIR(st.st_mode);
+#endif
+  return true;
+}
+
+static void emit(poll_root* root, int mask, const char* path, int path_len, const char* name) {
+  int name_len = (name != NULL ? strlen(name) + 1 : 0);
+  poll_event* event = malloc(sizeof(poll_event) + path_len + name_len + 1);
+  if (event == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    return;
+  }
+  event->id = root->id;
+  event->mask = mask;
+  memcpy(event->path, path, path_len);
+  if (name != NULL) {
+    event->path[path_len] = '/';
+    memcpy(event->path + path_len + 1, name, name_len);
+  }
+  event->path[path_len + name_len] = '\0';
+
+  pthread_mutex_lock(&queue_lock);
+  if (array_push(queue, event) == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    free(event);
+  }
+  pthread_mutex_unlock(&queue_lock);
+  atomic_fetch_add(&root->changes, 1);
+}
+
+static void emit_diff(poll_dir* dir, poll_entry* entry, file_state* old) {
+  if (old->dir != entry->state.dir) {
+    emit(dir->root, IN_DELETE | (old->dir ? IN_ISDIR : 0), dir->path, dir->path_len, entry->name);
+    emit(dir->root, IN_CREATE | (entry->state.dir ? IN_ISDIR : 0), dir->path, dir->path_len, entry->name);
+  }
+  else if (!entry->state.dir && (old->mtime != entry->state.mtime || old->size != entry->state.size)) {
+    emit(dir->root, IN_MODIFY, dir->path, dir->path_len, entry->name);
+  }
+  else if (old->ctime != entry->state.ctime) {
+    emit(dir->root, IN_ATTRIB | (entry->state.dir ? IN_ISDIR : 0), dir->path, dir->path_len, entry->name);
+  }
+}
+
+
+static poll_dir* new_poll_dir(poll_root* root, const char* path, int path_len, const char* name) {
+  int name_len = (name != NULL ? strlen(name) + 1 : 0);
+  poll_dir* dir = calloc(1, sizeof(poll_dir) + path_len + name_len + 1);
+  CHECK_NULL(dir, NULL);
+  dir->root = root;
+  dir->fresh = true;
+  memcpy(dir->path, path, path_len);
+  if (name != NULL) {
+    dir->path[path_len] = '/';
+    memcpy(dir->path + path_len + 1, name, name_len);
+  }
+  dir->path_len = path_len + name_len;
+  dir->path[dir->path_len] = '\0';
+  return dir;
+}
+
+static void free_entries(poll_entry* entries, int count) {
+  for (int i=0; i<count; i++) {
+    free(entries[i].name);
+    free_poll_dir(entries[i].sub);
+  }
+  free(entries);
+}
+
+static void free_poll_dir(poll_dir* dir) {
+  if (dir != NULL) {
+    free_entries(dir->entries, dir->count);
+    free(dir);
+  }
+}
+
+static int compare_names(const void* p1, const void* p2) {
+  return strcmp(*(char**)p1, *(char**)p2);
+}
+
+// a subdirectory gets its own snapshot unless it is excluded or the root is flat
+static void attach_sub(poll_dir* dir, poll_entry* entry) {
+  if (entry->state.dir && dir->root->recursive && entry->sub == NULL &&
+      !is_excluded_dir(dir->path, dir->path_len, entry->name)) {
+    entry->sub = new_poll_dir(dir->root, dir->path, dir->path_len, entry->name);
+  }
+}
+
+// re-reads the listing and merges it with the previous one; returns false if the directory cannot be read
+static bool rescan_dir(poll_dir* dir, int fd) {
+  int dup_fd = dup(fd);
+  DIR* d = (dup_fd >= 0 ? fdopendir(dup_fd) : NULL);
+  if (d == NULL) {
+    if (dup_fd >= 0) close(dup_fd);
+    return false;
+  }
+
+  array* names = array_create(dir->count > 0 ? dir->count : 16);
+  struct dirent* e;
+  while (names != NULL && (e = readdir(d)) != NULL) {
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+    char* name = strdup(e->d_name);
+    if (name == NULL || array_push(names, name) == NULL) {
+      free(name);
+      array_delete_vs_data(names);
+      names = NULL;
+    }
+  }
+  closedir(d);
+  CHECK_NULL(names, false);
+  array_sort(names, &compare_names);
+
+  int n = array_size(names);
+  poll_entry* entries = calloc(n > 0 ? n : 1, sizeof(poll_entry));
+  if (entries == NULL) {
+    array_delete_vs_data(names);
+    userlog(LOG_ERR, "out of memory");
+    return false;
+  }
+
+  int count = 0, old = 0;
+  for (int i=0; i<n; i++) {
+    char* name = array_get(names, i);
+    poll_entry* entry = &entries[count];
+    if (!read_state(fd, name, &entry->state)) {
+      free(name);
+      continue;
+    }
+    entry->name = name;
+    count++;
+
+    while (old < dir->count && strcmp(dir->entries[old].name, name) < 0) {
+      poll_entry* gone = &dir->entries[old++];
+      emit(dir->root, IN_DELETE | (gone->state.dir ? IN_ISDIR : 0), dir->path, dir->path_len, gone->name);
+    }
+    if (old < dir->count && strcmp(dir->entries[old].name, name) == 0) {
+      poll_entry* prev = &dir->entries[old++];
+      emit_diff(dir, entry, &prev->state);
+      if (prev->state.dir == entry->state.dir) {
+        entry->sub = prev->sub;
+        prev->sub = NULL;
+      }
+    }
+    else if (!dir->fresh) {
+      emit(dir->root, IN_CREATE | (entry->state.dir ? IN_ISDIR : 0), dir->path, dir->path_len, name);
+    }
+    attach_sub(dir, entry);
+  }
+  while (old < dir->count) {
+    poll_entry* gone = &dir->entries[old++];
+    emit(dir->root, IN_DELETE | (gone->state.dir ? IN_ISDIR : 0), dir->path, dir->path_len, gone->name);
+  }
+  array_delete(names);
+
+  free_entries(dir->entries, dir->count);
+  dir->entries = entries;
+  dir->count = count;
+  return true;
+}
+
+// the listing is known to be the same, only entries themselves may have changed;
+// returns false when an entry has vanished after all (stale attributes of the directory)
+static bool restat_dir(poll_dir* dir, int fd) {
+  for (int i=0; i<dir->count; i++) {
+    poll_entry* entry = &dir->entries[i];
+    file_state state;
+    if (!read_state(fd, entry->name, &state)) {
+      return false;
+    }
+    file_state old = entry->state;
+    entry->state = state;
+    emit_diff(dir, entry, &old);
+    if (old.dir != state.dir) {
+      free_poll_dir(entry->sub);
+      entry->sub = NULL;
+    }
+    attach_sub(dir, entry);
+  }
+  return true;
+}
+
+static void poll_directory(void* p) {
+  poll_dir* dir = p;
+
+  int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  file_state self;
+  if (fd < 0 || !read_state(fd, "", &self)) {
+    int error = errno;
+    userlog(LOG_DEBUG, "poll: cannot open %s: %s", dir->path, strerror(error));
+    if (fd >= 0) close(fd);
+    if (dir == dir->root->top && error == ENOENT) {
+      emit(dir->root, IN_DELETE_SELF, dir->path, dir->path_len, NULL);
+    }
+    return;
+  }
+
+  bool ok = !dir->fresh && self.mtime == dir->mtime && restat_dir(dir, fd);
+  if (!ok) {
+    ok = rescan_dir(dir, fd);
+  }
+  close(fd);
+  if (!ok) {
+    return;
+  }
+  dir->mtime = self.mtime;
+  dir->fresh = false;
+
+  for (int i=0; i<dir->count; i++) {
+    if (dir->entries[i].sub != NULL && !pool_submit(poll_pool, dir->entries[i].sub)) {
+      userlog(LOG_ERR, "out of memory");
+      break;
+    }
+  }
+}
+
+static void poll_file(poll_root* root) {
+  file_state state;
+  if (!read_state(AT_FDCWD, root->path, &state)) {
+    if (errno == ENOENT) {
+      emit(root, IN_DELETE_SELF, root->path, strlen(root->path), NULL);
+    }
+    return;
+  }
+  if (state.mtime != root->file.mtime || state.size != root->file.size) {
+    emit(root, IN_MODIFY, root->path, strlen(root->path), NULL);
+  }
+  else if (state.ctime != root->file.ctime) {
+    emit(root, IN_ATTRIB, root->path, strlen(root->path), NULL);
+  }
+  root->file = state;
+}
+
+static void poll_round(poll_root* root) {
+  atomic_store(&root->changes, 0);
+
+  if (root->top == NULL) {
+    poll_file(root);
+  }
+  else if (!pool_run(poll_pool, &poll_directory, root->top)) {
+    userlog(LOG_ERR, "out of memory");
+  }
+
+  int changes = atomic_load(&root->changes);
+  if (changes > 0) {
+    root->interval = root->interval / 2;
+    if (root->interval < root->min_interval) root->interval = root->min_interval;
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      userlog(LOG_ERR, "write(eventfd): %s", strerror(errno));
+    }
+  }
+  else {
+    root->interval += root->interval / 2;
+    int max_interval = (root->min_interval > MAX_POLL_INTERVAL / 2 ? root->min_interval * 2 : MAX_POLL_INTERVAL);
+    if (root->interval > max_interval) root->interval = max_interval;
+  }
+  userlog(LOG_DEBUG, "polled %s: %d changes, next in %d ms", root->path, changes, root->interval);
+}
+
+static void free_poll_root(poll_root* root) {
+  free_poll_dir(root->top);
+  free(root);
+}
+
+static void remove_root(int i) {
+  free_poll_root(array_get(roots, i));
+  array_put(roots, i, array_get(roots, array_size(roots) - 1));
+  array_pop(roots);
+}
+
+static void* poll_main(void* arg) {
+  (void)arg;
+  pthread_mutex_lock(&poll_lock);
+
+  while (!stopping) {
+    poll_root* next = NULL;
+    for (int i=0; i<array_size(roots); i++) {
+      poll_root* root = array_get(roots, i);
+      if (next == NULL || root->due < next->due) next = root;
+    }
+
+    if (next == NULL) {
+      pthread_cond_wait(&poll_wakeup, &poll_lock);
+      continue;
+    }
+    int64_t now = now_ms();
+    if (next->due > now) {
+      struct timespec deadline = {.tv_sec = next->due / 1000, .tv_nsec = (next->due % 1000) * 1000000};
+      pthread_cond_timedwait(&poll_wakeup, &poll_lock, &deadline);
+      continue;
+    }
+
+    next->busy = true;
+    if (next->reset && next->top != NULL) {
+      poll_dir* top = new_poll_dir(next, next->path, strlen(next->path), NULL);
+      if (top != NULL) {
+        free_poll_dir(next->top);
+        next->top = top;
+      }
+    }
+    next->reset = false;
+    pthread_mutex_unlock(&poll_lock);
+
+    poll_round(next);
+
+    pthread_mutex_lock(&poll_lock);
+    next->busy = false;
+    next->due = now_ms() + next->interval;
+    if (next->removed) {
+      for (int i=0; i<array_size(roots); i++) {
+        if (array_get(roots, i) == next) {
+          remove_root(i);
+          break;
+        }
+      }
+    }
+  }
+
+  pthread_mutex_unlock(&poll_lock);
+  return NULL;
+}
+
+
+static int add_poll_root(const char* root, int min_interval) {
+  bool recursive = true;
+  if (root[0] == '|') {
+    root++;
+    recursive = false;
+  }
+
+  struct stat st;
+  if (stat(root, &st) != 0) {
+    if (errno == ENOENT) {
+      return ERR_MISSING;
+    }
+    userlog(LOG_INFO, "stat(%s): %s", root, strerror(errno));
+    return ERR_CONTINUE;
+  }
+  if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+    userlog(LOG_WARNING, "unexpected node type: %s, %d", root, st.st_mode);
+    return ERR_IGNORE;
+  }
+
+  if (!start_polling()) {
+    return ERR_CONTINUE;  // reported as unwatchable
+  }
+
+  int path_len = strlen(root);
+  poll_root* r = calloc(1, sizeof(poll_root) + path_len + 1);
+  CHECK_NULL(r, ERR_ABORT);
+  memcpy(r->path, root, path_len + 1);
+  r->recursive = recursive;
+  r->interval = r->min_interval = min_interval;
+  r->due = now_ms();
+  atomic_init(&r->changes, 0);
+  if (S_ISDIR(st.st_mode)) {
+    if ((r->top = new_poll_dir(r, root, path_len, NULL)) == NULL) {
+      free(r);
+      return ERR_ABORT;
+    }
+  }
+  else {
+    read_state(AT_FDCWD, root, &r->file);
+  }
+
+  pthread_mutex_lock(&poll_lock);
+  r->id = next_id++;
+  bool ok = array_push(roots, r) != NULL;
+  pthread_cond_signal(&poll_wakeup);
+  pthread_mutex_unlock(&poll_lock);
+
+  if (!ok) {
+    free_poll_root(r);
+    userlog(LOG_ERR, "out of memory");
+    return ERR_ABORT;
+  }
+  userlog(LOG_INFO, "polling %s: %d", root, r->id);
+  return r->id;
+}
+
+int poll_watch(const char* root) {
+  return add_poll_root(root, MIN_POLL_INTERVAL);
+}
+
+int poll_watch_uncovered(const char* dir) {
+  return add_poll_root(dir, UNCOVERED_POLL_INTERVAL);
+}
+
+void poll_unwatch(int id) {
+  pthread_mutex_lock(&poll_lock);
+  for (int i=0; i<array_size(roots); i++) {
+    poll_root* root = array_get(roots, i);
+    if (root->id == id) {
+      if (root->busy) {
+        root->removed = true;
+      }
+      else {
+        remove_root(i);
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&poll_lock);
+}
+
+void poll_reset() {
+  pthread_mutex_lock(&poll_lock);
+  for (int i=0; i<array_size(roots); i++) {
+    ((poll_root*)array_get(roots, i))->reset = true;
+  }
+  pthread_mutex_unlock(&poll_lock);
+}
+
+static bool is_polled(int id) {
+  for (int i=0; i<array_size(roots); i++) {
+    poll_root* root = array_get(roots, i);
+    if (root->id == id) {
+      return !root->removed;
+    }
+  }
+  return false;
+}
+
+bool process_poll_input() {
+  uint64_t count;
+  if (read(event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    userlog(LOG_ERR, "read(eventfd): %s", strerror(errno));
+    return false;
+  }
+
+  array* events = array_create(64);
+  CHECK_NULL(events, false);
+  pthread_mutex_lock(&queue_lock);
+  array* pending = queue;
+  queue = events;
+  pthread_mutex_unlock(&queue_lock);
+
+  for (int i=0; i<array_size(pending); i++) {
+    poll_event* event = array_get(pending, i);
+    pthread_mutex_lock(&poll_lock);
+    bool live = is_polled(event->id);
+    pthread_mutex_unlock(&poll_lock);
+    userlog(LOG_DEBUG, "poll: id=%d mask=%d path=%s", event->id, event->mask, event->path);
+    if (live && callback != NULL) {
+      (*callback)(event->path, event->mask);
+    }
+  }
+  array_delete_vs_data(pending);
+
+  return true;
+}
+
+void close_polling() {
+  if (poll_started) {
+    pthread_mutex_lock(&poll_lock);
+    stopping = true;
+    pthread_cond_signal(&poll_wakeup);
+    pthread_mutex_unlock(&poll_lock);
+    pthread_join(poll_thread, NULL);
+    pthread_cond_destroy(&poll_wakeup);
+    poll_started = false;
+  }
+
+  while (array_size(roots) > 0) {
+    remove_root(0);
+  }
+  array_delete(roots);
+  roots = NULL;
+  array_delete_vs_data(queue);
+  queue = NULL;
+
+  pool_delete(poll_pool);
+  poll_pool = NULL;
+  if (event_fd >= 0) {
+    close(event_fd);
+    event_fd = -1;
+  }
+}
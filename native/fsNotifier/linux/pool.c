@@ -0,0 +1,290 @@
+/*
+ * Copyright 2000-2016 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+
+#define DEQUE_INITIAL_CAPACITY 64
+
+// An owner pushes and pops at the tail (LIFO, keeps the walk depth-first and cache-friendly),
+// thieves take from the head (FIFO, grabbing the largest unexplored subtrees first).
+typedef struct {
+  pthread_mutex_t lock;
+  void** items;
+  int head;
+  int size;
+  int capacity;
+} deque;
+
+typedef struct {
+  pthread_t thread;
+  pool* owner;
+  int index;
+} worker;
+
+struct __pool {
+  int size;
+  worker* workers;
+  deque* deques;
+  void (* process)(void*);
+
+  atomic_long pending;  // submitted but not yet processed items
+  atomic_long queued;   // items sitting in deques
+  atomic_int idle;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;
+  unsigned long generation;
+  bool shutdown;
+};
+
+static _Thread_local int current_worker = 0;
+
+static void* worker_main(void* arg);
+
+
+static bool deque_push(deque* d, void* item) {
+  pthread_mutex_lock(&d->lock);
+  if (d->size == d->capacity) {
+    int new_cap = d->capacity * 2;
+    void** new_items = malloc(sizeof(void*) * new_cap);
+    if (new_items == NULL) {
+      pthread_mutex_unlock(&d->lock);
+      return false;
+    }
+    for (int i=0; i<d->size; i++) {
+      new_items[i] = d->items[(d->head + i) % d->capacity];
+    }
+    free(d->items);
+    d->items = new_items;
+    d->head = 0;
+    d->capacity = new_cap;
+  }
+  d->items[(d->head + d->size) % d->capacity] = item;
+  d->size++;
+  pthread_mutex_unlock(&d->lock);
+  return true;
+}
+
+static void* deque_take(deque* d, bool steal) {
+  void* item = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->size > 0) {
+    if (steal) {
+      item = d->items[d->head];
+      d->head = (d->head + 1) % d->capacity;
+    }
+    else {
+      item = d->items[(d->head + d->size - 1) % d->capacity];
+    }
+    d->size--;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return item;
+}
+
+
+pool* pool_create(int threads) {
+  if (threads < 1) {
+    threads = 1;
+  }
+
+  pool* p = calloc(1, sizeof(pool));
+  CHECK_NULL(p, NULL);
+  p->deques = calloc(threads, sizeof(deque));
+  p->workers = calloc(threads, sizeof(worker));
+  if (p->deques == NULL || p->workers == NULL) {
+    free(p->deques);
+    free(p->workers);
+    free(p);
+    userlog(LOG_ERR, "out of memory");
+    return NULL;
+  }
+
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wakeup, NULL);
+  atomic_init(&p->pending, 0);
+  atomic_init(&p->queued, 0);
+  atomic_init(&p->idle, 0);
+
+  // worker #0 is whoever calls pool_run()
+  p->size = 1;
+  pthread_mutex_init(&p->deques[0].lock, NULL);
+  p->deques[0].items = malloc(sizeof(void*) * DEQUE_INITIAL_CAPACITY);
+  p->deques[0].capacity = DEQUE_INITIAL_CAPACITY;
+  if (p->deques[0].items == NULL) {
+    pool_delete(p);
+    userlog(LOG_ERR, "out of memory");
+    return NULL;
+  }
+
+  for (int i=1; i<threads; i++) {
+    deque* d = &p->deques[i];
+    d->items = malloc(sizeof(void*) * DEQUE_INITIAL_CAPACITY);
+    if (d->items == NULL) {
+      break;
+    }
+    d->capacity = DEQUE_INITIAL_CAPACITY;
+    pthread_mutex_init(&d->lock, NULL);
+
+    worker* w = &p->workers[i];
+    w->owner = p;
+    w->index = i;
+    int rc = pthread_create(&w->thread, NULL, &worker_main, w);
+    if (rc != 0) {
+      userlog(LOG_WARNING, "pthread_create: %s", strerror(rc));
+      pthread_mutex_destroy(&d->lock);
+      free(d->items);
+      break;
+    }
+    p->size = i + 1;
+  }
+
+  userlog(LOG_DEBUG, "pool: %d workers", p->size);
+  return p;
+}
+
+int pool_size(pool* p) {
+  return (p != NULL ? p->size : 0);
+}
+
+bool pool_submit(pool* p, void* item) {
+  if (!deque_push(&p->deques[current_worker], item)) {
+    return false;
+  }
+  atomic_fetch_add(&p->pending, 1);
+  atomic_fetch_add(&p->queued, 1);
+
+  if (atomic_load(&p->idle) > 0) {
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->wakeup);
+    pthread_mutex_unlock(&p->lock);
+  }
+  return true;
+}
+
+static void* next_item(pool* p, int worker) {
+  void* item = deque_take(&p->deques[worker], false);
+  for (int i=1; item == NULL && i<p->size; i++) {
+    item = deque_take(&p->deques[(worker + i) % p->size], true);
+  }
+  if (item != NULL) {
+    atomic_fetch_sub(&p->queued, 1);
+  }
+  return item;
+}
+
+static void run_worker(pool* p, int worker) {
+  while (true) {
+    void* item = next_item(p, worker);
+    if (item != NULL) {
+      (*p->process)(item);
+      if (atomic_fetch_sub(&p->pending, 1) == 1) {
+        pthread_mutex_lock(&p->lock);
+        pthread_cond_broadcast(&p->wakeup);
+        pthread_mutex_unlock(&p->lock);
+      }
+      continue;
+    }
+
+    if (atomic_load(&p->pending) == 0) {
+      return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    atomic_fetch_add(&p->idle, 1);
+    while (atomic_load(&p->queued) == 0 && atomic_load(&p->pending) > 0 && !p->shutdown) {
+      pthread_cond_wait(&p->wakeup, &p->lock);
+    }
+    atomic_fetch_sub(&p->idle, 1);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+static void* worker_main(void* arg) {
+  worker* w = arg;
+  pool* p = w->owner;
+  current_worker = w->index;
+
+  pthread_mutex_lock(&p->lock);
+  unsigned long seen = 0;
+  while (!p->shutdown) {
+    if (p->generation == seen) {
+      pthread_cond_wait(&p->wakeup, &p->lock);
+      continue;
+    }
+    seen = p->generation;
+    pthread_mutex_unlock(&p->lock);
+
+    run_worker(p, w->index);
+
+    pthread_mutex_lock(&p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return NULL;
+}
+
+bool pool_run(pool* p, void (* process)(void*), void* item) {
+  current_worker = 0;
+
+  pthread_mutex_lock(&p->lock);
+  p->process = process;
+  if (!deque_push(&p->deques[0], item)) {
+    pthread_mutex_unlock(&p->lock);
+    return false;
+  }
+  atomic_store(&p->pending, 1);
+  atomic_store(&p->queued, 1);
+  p->generation++;
+  pthread_cond_broadcast(&p->wakeup);
+  pthread_mutex_unlock(&p->lock);
+
+  run_worker(p, 0);
+  return true;
+}
+
+void pool_delete(pool* p) {
+  if (p == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->shutdown = true;
+  pthread_cond_broadcast(&p->wakeup);
+  pthread_mutex_unlock(&p->lock);
+
+  for (int i=1; i<p->size; i++) {
+    pthread_join(p->workers[i].thread, NULL);
+  }
+
+  for (int i=0; i<p->size; i++) {
+    free(p->deques[i].items);
+    pthread_mutex_destroy(&p->deques[i].lock);
+  }
+  pthread_cond_destroy(&p->wakeup);
+  pthread_mutex_destroy(&p->lock);
+  free(p->deques);
+  free(p->workers);
+  free(p);
+}
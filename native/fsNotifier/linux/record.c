@@ -0,0 +1,229 @@
+/*
+ * Copyright 2000-2016 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+#include <unistd.h>
+
+
+// Recordings of the inotify subsystem: raw events as read from the kernel, interleaved with changes
+// of the watch tree in the order they were made (so that the tree is rebuilt exactly on replay),
+// and marks of where each read() ended. Records are appended; fields are in native byte order.
+#define RECORD_MAGIC "FSNR"
+#define RECORD_VERSION 1
+#define RECORD_MAX_PAYLOAD (64 * 1024)
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+} record_header;
+
+typedef struct {
+  uint32_t type;
+  int32_t wd;
+  int32_t parent;
+  uint32_t len;  // of the payload following the record
+} record;
+
+static FILE* record_file = NULL;
+static FILE* replay_file = NULL;
+static char* replay_buf = NULL;
+static uint32_t replay_buf_len = 0;
+
+
+bool init_recording() {
+  const char* name = getenv(RECORD_ENV);
+  if (name == NULL || name[0] == '\0') {
+    return false;
+  }
+
+  record_file = fopen(name, "we");
+  if (record_file == NULL) {
+    userlog(LOG_WARNING, "recording %s: %s", name, strerror(errno));
+    return false;
+  }
+  record_header header = {RECORD_MAGIC, RECORD_VERSION};
+  if (fwrite(&header, sizeof(header), 1, record_file) != 1) {
+    userlog(LOG_WARNING, "recording %s: %s", name, strerror(errno));
+    fclose(record_file);
+    record_file = NULL;
+    return false;
+  }
+  userlog(LOG_INFO, "recording events to %s", name);
+  return true;
+}
+
+// called from walker threads too; a record and its payload are kept together
+void record_append(record_type type, int wd, int parent, const void* payload, uint32_t len) {
+  if (record_file == NULL) {
+    return;
+  }
+
+  record r = {type, wd, parent, len};
+  flockfile(record_file);
+  bool ok = fwrite(&r, sizeof(r), 1, record_file) == 1 && (len == 0 || fwrite(payload, len, 1, record_file) == 1);
+  funlockfile(record_file);
+  if (!ok) {
+    userlog(LOG_WARNING, "recording stopped: %s", strerror(errno));
+    fclose(record_file);
+    record_file = NULL;
+  }
+}
+
+void close_recording() {
+  if (record_file != NULL) {
+    fclose(record_file);
+    record_file = NULL;
+  }
+}
+
+
+bool replay_open(const char* name) {
+  replay_file = fopen(name, "re");
+  if (replay_file == NULL) {
+    userlog(LOG_ERR, "replay %s: %s", name, strerror(errno));
+    return false;
+  }
+
+  record_header header;
+  if (fread(&header, sizeof(header), 1, replay_file) != 1 ||
+      memcmp(header.magic, RECORD_MAGIC, 4) != 0 || header.version != RECORD_VERSION) {
+    userlog(LOG_ERR, "replay %s: not a recording", name);
+    replay_close();
+    return false;
+  }
+  return true;
+}
+
+// the payload stays valid until the next call; returns false at the end of the recording (a truncated tail is ignored)
+bool replay_next(record_type* type, int* wd, int* parent, const char** payload, uint32_t* len) {
+  record r;
+  if (replay_file == NULL || fread(&r, sizeof(r), 1, replay_file) != 1 || r.len > RECORD_MAX_PAYLOAD) {
+    return false;
+  }
+
+  if (r.len + 1 > replay_buf_len) {
+    uint32_t new_len = (replay_buf_len > 0 ? replay_buf_len : 4096);
+    while (new_len < r.len + 1) new_len *= 2;
+    char* new_buf = realloc(replay_buf, new_len);
+    CHECK_NULL(new_buf, false);
+    replay_buf = new_buf;
+    replay_buf_len = new_len;
+  }
+  if (r.len > 0 && fread(replay_buf, r.len, 1, replay_file) != 1) {
+    return false;
+  }
+  replay_buf[r.len] = '\0';
+
+  *type = r.type;
+  *wd = r.wd;
+  *parent = r.parent;
+  *payload = replay_buf;
+  *len = r.len;
+  return true;
+}
+
+void replay_close() {
+  if (replay_file != NULL) {
+    fclose(replay_file);
+    replay_file = NULL;
+  }
+  free(replay_buf);
+  replay_buf = NULL;
+  replay_buf_len = 0;
+}
+
+
+// Stands in for the kernel and the disk during a replay: watches come from the recording, so there is nothing
+// to add, remove or read; no inotify instance is taken (nor counted against the per-user limit).
+static int replay_fd = -1;
+
+static int replay_init() {
+  replay_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return replay_fd;
+}
+
+static int replay_watch_limit() {
+  return INT_MAX;
+}
+
+static int replay_add_watch(const char* path, uint32_t mask) {
+  (void)path; (void)mask;
+  errno = ENOENT;
+  return -1;
+}
+
+static int replay_rm_watch(int wd) {
+  (void)wd;
+  return 0;
+}
+
+static ssize_t replay_read_events(char* buf, size_t len) {
+  (void)buf; (void)len;
+  errno = EAGAIN;
+  return -1;
+}
+
+static void replay_close_fd() {
+  if (replay_fd >= 0) {
+    close(replay_fd);
+    replay_fd = -1;
+  }
+}
+
+static int replay_stat(const char* path, struct stat* st) {
+  (void)path; (void)st;
+  errno = ENOENT;
+  return -1;
+}
+
+static void* replay_open_dir(const char* path) {
+  (void)path;
+  errno = ENOENT;
+  return NULL;
+}
+
+static const char* replay_next_subdir(void* dir, bool* unknown) {
+  (void)dir;
+  *unknown = false;
+  return NULL;
+}
+
+static bool replay_has_subdir(void* dir, const char* name) {
+  (void)dir; (void)name;
+  return false;
+}
+
+static int replay_dir_fd(void* dir) {
+  (void)dir;
+  return -1;
+}
+
+static void replay_close_dir(void* dir) {
+  (void)dir;
+}
+
+const watch_backend replay_backend = {
+  "replay", &replay_init, &replay_watch_limit, &replay_add_watch, &replay_rm_watch, &replay_read_events,
+  &replay_close_fd, &replay_stat, &replay_open_dir, &replay_next_subdir, &replay_has_subdir, &replay_has_subdir,
+  &replay_dir_fd, &replay_close_dir
+};
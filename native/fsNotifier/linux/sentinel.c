@@ -0,0 +1,303 @@
+/*
+ * Copyright 2000-2016 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+// A missing root is awaited by watching its nearest existing ancestor for the next path component;
+// the sentinel moves down as components appear (and up when the ancestor itself goes away).
+// Sentinels use an inotify instance of their own, so their watches never mix with watch trees.
+
+#define SENTINEL_MASK (IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+#define EVENT_SIZE (sizeof(struct inotify_event))
+#define EVENT_BUF_LEN (64 * (EVENT_SIZE + NAME_MAX + 1))
+
+typedef struct {
+  int wd;
+  int refs;
+  int ancestor_len;  // `path` up to here exists and is watched
+  char path[];
+} sentinel;
+
+static int sentinel_fd = -1;
+static array* sentinels = NULL;
+static void (* callback)(const char*, bool) = NULL;
+
+
+bool init_sentinels() {
+  sentinel_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (sentinel_fd < 0) {
+    userlog(LOG_WARNING, "inotify_init1 (sentinels): %s", strerror(errno));
+    return false;
+  }
+  sentinels = array_create(8);
+  CHECK_NULL(sentinels, false);
+  return true;
+}
+
+void set_sentinel_callback(void (* _callback)(const char*, bool)) {
+  callback = _callback;
+}
+
+int get_sentinel_fd() {
+  return sentinel_fd;
+}
+
+
+static bool wd_in_use(int wd) {
+  for (int i=0; i<array_size(sentinels); i++) {
+    if (((sentinel*)array_get(sentinels, i))->wd == wd) return true;
+  }
+  return false;
+}
+
+static void release_wd(int wd) {
+  if (wd >= 0 && !wd_in_use(wd)) {
+    inotify_rm_watch(sentinel_fd, wd);
+  }
+}
+
+// finds the nearest existing ancestor, descending past directories which have appeared meanwhile;
+// returns 1 when the path itself exists, 0 when the sentinel is placed, -1 on failure
+// (including a non-directory in the way, which cannot become a directory without further events)
+static int place(sentinel* s) {
+  int len = strlen(s->path);
+  char buf[len + 2];
+
+  while (true) {
+    int old_wd = s->wd;
+    s->wd = -1;
+
+    struct stat st;
+    if (stat(s->path, &st) == 0) {
+      release_wd(old_wd);
+      return 1;
+    }
+
+    memcpy(buf, s->path, len + 1);
+    int ancestor_len = len;
+    while (true) {
+      while (ancestor_len > 0 && buf[ancestor_len] != '/') ancestor_len--;
+      if (ancestor_len == 0) {
+        strcpy(buf, "/");
+      }
+      else {
+        buf[ancestor_len] = '\0';
+      }
+
+      int wd = inotify_add_watch(sentinel_fd, buf, SENTINEL_MASK);
+      if (wd >= 0) {
+        s->wd = wd;
+        s->ancestor_len = ancestor_len;
+        break;
+      }
+      if (errno != ENOENT && errno != ENOTDIR) {
+        userlog(LOG_INFO, "inotify_add_watch(%s): %s", buf, strerror(errno));
+        release_wd(old_wd);
+        return -1;
+      }
+      if (ancestor_len == 0) {
+        release_wd(old_wd);
+        return -1;
+      }
+      ancestor_len--;
+    }
+
+    if (s->wd != old_wd) {
+      release_wd(old_wd);
+    }
+
+    // the next component might have appeared before the watch was in place
+    char* slash = strchr(s->path + ancestor_len + 1, '/');
+    int next_len = (slash != NULL ? slash - s->path : len);
+    memcpy(buf, s->path, next_len);
+    buf[next_len] = '\0';
+    if (stat(buf, &st) != 0) {
+      break;
+    }
+    if (!S_ISDIR(st.st_mode) || next_len <= ancestor_len) {
+      userlog(LOG_INFO, "sentinel for %s: %s is not a directory", s->path, buf);
+      return -1;
+    }
+  }
+
+  userlog(LOG_DEBUG, "sentinel for %s at %.*s: %d", s->path, s->ancestor_len > 0 ? s->ancestor_len : 1, s->path, s->wd);
+  return 0;
+}
+
+static void remove_sentinel(int i) {
+  sentinel* s = array_get(sentinels, i);
+  array_put(sentinels, i, array_get(sentinels, array_size(sentinels) - 1));
+  array_pop(sentinels);
+  release_wd(s->wd);
+  free(s);
+}
+
+// returns false when the path cannot be awaited (the caller has to poll it); the path may also exist already,
+// in which case the callback is invoked right away. Later on, the callback reports either the path's appearance
+// or the loss of the sentinel (e.g. an ancestor became inaccessible).
+bool sentinel_watch(const char* path) {
+  if (sentinel_fd < 0 || path[0] != '/') {
+    return false;
+  }
+  for (int i=0; i<array_size(sentinels); i++) {
+    sentinel* s = array_get(sentinels, i);
+    if (strcmp(s->path, path) == 0) {
+      s->refs++;
+      return true;
+    }
+  }
+
+  int len = strlen(path);
+  sentinel* s = malloc(sizeof(sentinel) + len + 1);
+  CHECK_NULL(s, false);
+  memcpy(s->path, path, len + 1);
+  s->wd = -1;
+  s->refs = 1;
+  if (array_push(sentinels, s) == NULL) {
+    free(s);
+    userlog(LOG_ERR, "out of memory");
+    return false;
+  }
+
+  int result = place(s);
+  if (result < 0) {
+    remove_sentinel(array_size(sentinels) - 1);
+    return false;
+  }
+  if (result > 0) {
+    remove_sentinel(array_size(sentinels) - 1);
+    if (callback != NULL) {
+      (*callback)(path, true);
+    }
+  }
+  return true;
+}
+
+void sentinel_unwatch(const char* path) {
+  for (int i=0; i<array_size(sentinels); i++) {
+    sentinel* s = array_get(sentinels, i);
+    if (strcmp(s->path, path) == 0) {
+      if (--s->refs == 0) {
+        remove_sentinel(i);
+      }
+      return;
+    }
+  }
+}
+
+
+// moves the sentinel; returns false when it is done with (the path has appeared, or cannot be awaited anymore)
+static bool replace(int i, array* done) {
+  sentinel* s = array_get(sentinels, i);
+  int result = place(s);
+  if (result == 0) {
+    return true;
+  }
+
+  if (result < 0) {
+    userlog(LOG_INFO, "sentinel lost: %s", s->path);
+    s->path[0] = '!';  // marks the loss for process_sentinel_input()
+  }
+  char* path = strdup(s->path);
+  if (path == NULL || array_push(done, path) == NULL) {
+    free(path);
+    userlog(LOG_ERR, "out of memory");
+  }
+  remove_sentinel(i);
+  return false;
+}
+
+static void process_event(struct inotify_event* event, array* done) {
+  for (int i=0; i<array_size(sentinels); i++) {
+    sentinel* s = array_get(sentinels, i);
+    if (s->wd != event->wd) continue;
+
+    if (!(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))) {
+      // only the next component of the awaited path matters
+      const char* next = s->path + s->ancestor_len + 1;
+      int next_len = strcspn(next, "/");
+      if (event->len == 0 || strncmp(event->name, next, next_len) != 0 || event->name[next_len] != '\0') continue;
+    }
+
+    if (!replace(i, done)) {
+      i--;
+    }
+  }
+}
+
+bool process_sentinel_input() {
+  char buf[EVENT_BUF_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
+  array* done = array_create(4);
+  CHECK_NULL(done, false);
+
+  while (true) {
+    ssize_t len = read(sentinel_fd, buf, sizeof(buf));
+    if (len < 0) {
+      if (errno == EAGAIN) break;
+      if (errno == EINTR) continue;
+      userlog(LOG_ERR, "read: %s", strerror(errno));
+      array_delete_vs_data(done);
+      return false;
+    }
+
+    for (ssize_t i = 0; i < len; ) {
+      struct inotify_event* event = (struct inotify_event*)&buf[i];
+      i += EVENT_SIZE + event->len;
+      if (event->mask & IN_Q_OVERFLOW) {
+        // anything might have happened - all sentinels are placed anew
+        for (int j = array_size(sentinels) - 1; j >= 0; j--) {
+          replace(j, done);
+        }
+        continue;
+      }
+      process_event(event, done);
+    }
+  }
+
+  for (int i=0; i<array_size(done); i++) {
+    char* path = array_get(done, i);
+    bool appeared = path[0] == '/';
+    path[0] = '/';
+    userlog(LOG_DEBUG, "awaited path %s: %s", appeared ? "appeared" : "lost", path);
+    if (callback != NULL) {
+      (*callback)(path, appeared);
+    }
+  }
+  array_delete_vs_data(done);
+  return true;
+}
+
+void close_sentinels() {
+  while (array_size(sentinels) > 0) {
+    free(array_pop(sentinels));
+  }
+  array_delete(sentinels);
+  sentinels = NULL;
+  if (sentinel_fd >= 0) {
+    close(sentinel_fd);
+    sentinel_fd = -1;
+  }
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright 2000-2016 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// The simulated tree is not stored: "/sim/d3/d0" is valid while every component is below the fan-out
+// and there are no more components than the depth. Called from walker threads, hence no mutable state
+// except for atomic counters.
+typedef struct {
+  int level;
+  int next;
+  char name[16];
+} sim_dir;
+
+static int sim_depth = 0;
+static int sim_fanout = 0;
+static int event_fd = -1;
+static atomic_int next_wd = 1;
+
+
+void sim_configure(int depth, int fanout) {
+  sim_depth = depth;
+  sim_fanout = fanout;
+}
+
+uint64_t sim_directory_count() {
+  uint64_t total = 0, level = 1;
+  for (int i=0; i<=sim_depth; i++) {
+    total += level;
+    level *= sim_fanout;
+  }
+  return total;
+}
+
+// index of the subdirectory named by `name` ("d<index>", up to `len` chars), or -1
+static int parse_name(const char* name, int len) {
+  if (len < 2 || len > 10 || name[0] != 'd' || (name[1] == '0' && len > 2)) {
+    return -1;
+  }
+  int index = 0;
+  for (int i=1; i<len; i++) {
+    if (name[i] < '0' || name[i] > '9') return -1;
+    index = index * 10 + (name[i] - '0');
+  }
+  return (index < sim_fanout ? index : -1);
+}
+
+// depth of the directory, or -1 (with errno set) when there is no such directory
+static int parse_path(const char* path) {
+  int root_len = strlen(SIM_ROOT);
+  if (strncmp(path, SIM_ROOT, root_len) != 0 || (path[root_len] != '\0' && path[root_len] != '/')) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  int level = 0;
+  const char* p = path + root_len;
+  while (*p == '/') {
+    const char* name = p + 1;
+    const char* end = strchr(name, '/');
+    if (end == NULL) end = name + strlen(name);
+    if (level == sim_depth || parse_name(name, end - name) < 0) {
+      errno = ENOENT;
+      return -1;
+    }
+    level++;
+    p = end;
+  }
+  return level;
+}
+
+
+static int sim_init() {
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  return event_fd;
+}
+
+static int sim_watch_limit() {
+  return INT_MAX;
+}
+
+static int sim_add_watch(const char* path, uint32_t mask) {
+  (void)mask;
+  if (parse_path(path) < 0) {
+    return -1;
+  }
+  return atomic_fetch_add(&next_wd, 1);
+}
+
+static int sim_rm_watch(int wd) {
+  if (wd <= 0 || wd >= atomic_load(&next_wd)) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+static ssize_t sim_read_events(char* buf, size_t len) {
+  (void)buf; (void)len;
+  errno = EAGAIN;
+  return -1;
+}
+
+static void sim_close() {
+  if (event_fd >= 0) {
+    close(event_fd);
+    event_fd = -1;
+  }
+}
+
+static int sim_stat(const char* path, struct stat* st) {
+  if (parse_path(path) < 0) {
+    return -1;
+  }
+  memset(st, 0, sizeof(struct stat));
+  st->st_mode = S_IFDIR | 0755;
+  return 0;
+}
+
+static void* sim_open_dir(const char* path) {
+  int level = parse_path(path);
+  if (level < 0) {
+    return NULL;
+  }
+  sim_dir* dir = malloc(sizeof(sim_dir));
+  if (dir == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  dir->level = level;
+  dir->next = 0;
+  return dir;
+}
+
+static const char* sim_next_subdir(void* p, bool* unknown) {
+  sim_dir* dir = p;
+  *unknown = false;
+  if (dir->level == sim_depth || dir->next == sim_fanout) {
+    return NULL;
+  }
+  snprintf(dir->name, sizeof(dir->name), "d%d", dir->next++);
+  return dir->name;
+}
+
+static bool sim_has_subdir(void* p, const char* name) {
+  sim_dir* dir = p;
+  return dir->level < sim_depth && parse_name(name, strlen(name)) >= 0;
+}
+
+static int sim_dir_fd(void* dir) {
+  (void)dir;
+  return -1;
+}
+
+static void sim_close_dir(void* dir) {
+  free(dir);
+}
+
+const watch_backend sim_backend = {
+  "simulation", &sim_init, &sim_watch_limit, &sim_add_watch, &sim_rm_watch, &sim_read_events, &sim_close,
+  &sim_stat, &sim_open_dir, &sim_next_subdir, &sim_has_subdir, &sim_has_subdir, &sim_dir_fd, &sim_close_dir
+};
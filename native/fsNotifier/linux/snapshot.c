@@ -0,0 +1,647 @@
+/*
+ * Copyright 2000-2016 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+// Listings of watched directories (by watch descriptor), taken when a directory is walked and kept current
+// by events on its entries. When a walk comes across a directory with a listing (i.e. on recovery from lost events),
+// the disk is compared to the listing, and the differences are queued as ordinary events.
+//
+// Optionally, listings are saved to a file on exit. On the next start the file is mapped, and directories
+// walked by the first ROOTS command are compared to their saved listings in the same way.
+
+typedef struct {
+  char* name;
+  uint64_t ino;
+  int64_t mtime;  // nanoseconds
+  int64_t size;
+  uint32_t type;  // S_IFMT bits
+} snapshot_entry;
+
+typedef struct dir_listing {
+  struct dir_listing* prev;
+  struct dir_listing* next;
+  int wd;
+  snapshot_entry* entries;  // sorted by name
+  int count;
+  int capacity;
+} dir_listing;
+
+typedef struct {
+  const char* event;
+  char path[];
+} snapshot_change;
+
+// The saved file: a header, then entries of all directories, then directories sorted by path,
+// then the strings they refer to (as offsets into the string pool).
+#define SNAPSHOT_MAGIC "FSNS"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t dir_count;
+  uint32_t entry_count;
+} saved_header;
+
+typedef struct {
+  uint64_t ino;
+  int64_t mtime;
+  int64_t size;
+  uint32_t name;
+  uint32_t type;
+} saved_entry;
+
+typedef struct {
+  uint32_t path;
+  uint32_t first;
+  uint32_t count;
+} saved_dir;
+
+static char* saved_file = NULL;
+static bool saved_pending = false;  // until the first roots are walked
+static char* saved_map = NULL;
+static size_t saved_size = 0;
+static const saved_entry* saved_entries = NULL;
+static const saved_dir* saved_dirs = NULL;
+static const char* saved_strings = NULL;
+static uint32_t saved_strings_len = 0;
+
+static table* listings = NULL;
+static dir_listing* all_listings = NULL;  // the table cannot be iterated
+static array* changes = NULL;
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void load_saved();
+static void unmap_saved();
+
+bool init_snapshots() {
+  const char* env = getenv(SNAPSHOT_ENV);
+  const char* file = getenv(SNAPSHOT_FILE_ENV);
+  if ((env == NULL || env[0] == '\0' || strcmp(env, "0") == 0) && (file == NULL || file[0] == '\0')) {
+    return false;
+  }
+
+  listings = table_create(1024);
+  changes = array_create(16);
+  if (listings == NULL || changes == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    close_snapshots();
+    return false;
+  }
+  userlog(LOG_INFO, "directory snapshots enabled");
+
+  if (file != NULL && file[0] != '\0') {
+    saved_file = strdup(file);
+    CHECK_NULL(saved_file, true);
+    saved_pending = true;
+    load_saved();
+  }
+  return true;
+}
+
+// maps the file left by the previous run; the file is removed right away, so that a run which does not finish
+// cleanly leaves nothing behind (a stale file would hide changes seen by that run)
+static void load_saved() {
+  int fd = open(saved_file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    userlog(errno == ENOENT ? LOG_INFO : LOG_WARNING, "snapshot %s: %s", saved_file, strerror(errno));
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(saved_header)) {
+    userlog(LOG_WARNING, "snapshot %s: invalid", saved_file);
+    close(fd);
+    return;
+  }
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  unlink(saved_file);
+  if (map == MAP_FAILED) {
+    userlog(LOG_WARNING, "mmap(%s): %s", saved_file, strerror(errno));
+    return;
+  }
+  saved_map = map;
+  saved_size = st.st_size;
+
+  const saved_header* header = map;
+  uint64_t strings_at = sizeof(saved_header) +
+                        (uint64_t)header->entry_count * sizeof(saved_entry) + (uint64_t)header->dir_count * sizeof(saved_dir);
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, 4) != 0 || header->version != SNAPSHOT_VERSION ||
+      strings_at >= saved_size || saved_size - strings_at > UINT32_MAX || saved_map[saved_size - 1] != '\0') {
+    userlog(LOG_WARNING, "snapshot %s: invalid", saved_file);
+    unmap_saved();
+    return;
+  }
+
+  saved_entries = (const saved_entry*)(saved_map + sizeof(saved_header));
+  saved_dirs = (const saved_dir*)(saved_entries + header->entry_count);
+  saved_strings = saved_map + strings_at;
+  saved_strings_len = saved_size - strings_at;
+  userlog(LOG_INFO, "snapshot %s: %u directories, %u entries", saved_file, header->dir_count, header->entry_count);
+}
+
+static void unmap_saved() {
+  if (saved_map != NULL) {
+    munmap(saved_map, saved_size);
+    saved_map = NULL;
+    saved_entries = NULL;
+    saved_dirs = NULL;
+    saved_strings = NULL;
+  }
+}
+
+static const saved_dir* find_saved(const char* path) {
+  if (saved_map == NULL) {
+    return NULL;
+  }
+  uint32_t lo = 0, hi = ((const saved_header*)saved_map)->dir_count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (saved_dirs[mid].path >= saved_strings_len) {
+      return NULL;
+    }
+    int c = strcmp(saved_strings + saved_dirs[mid].path, path);
+    if (c == 0) {
+      return &saved_dirs[mid];
+    }
+    if (c < 0) lo = mid + 1; else hi = mid;
+  }
+  return NULL;
+}
+
+// whether the directory was known to the previous run (and so its changes since then are reported)
+bool snapshot_saved(const char* path) {
+  return find_saved(path) != NULL;
+}
+
+// true until the first roots are registered, even when there was nothing to load (all roots are new then)
+bool snapshot_has_saved() {
+  return saved_pending;
+}
+
+void snapshot_release_saved() {
+  saved_pending = false;
+  unmap_saved();
+}
+
+
+static void fill_entry(snapshot_entry* entry, struct stat* st) {
+  entry->ino = st->st_ino;
+  entry->mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+  entry->size = st->st_size;
+  entry->type = st->st_mode & S_IFMT;
+}
+
+static bool grow_listing(dir_listing* listing) {
+  if (listing->count < listing->capacity) {
+    return true;
+  }
+  int new_capacity = (listing->capacity > 0 ? listing->capacity * 2 : 16);
+  snapshot_entry* new_entries = realloc(listing->entries, new_capacity * sizeof(snapshot_entry));
+  if (new_entries == NULL) {
+    return false;
+  }
+  listing->entries = new_entries;
+  listing->capacity = new_capacity;
+  return true;
+}
+
+// the position of the name in the listing, or where it should be inserted
+static int find_entry(dir_listing* listing, const char* name, bool* found) {
+  int lo = 0, hi = listing->count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    int c = strcmp(listing->entries[mid].name, name);
+    if (c == 0) {
+      *found = true;
+      return mid;
+    }
+    if (c < 0) lo = mid + 1; else hi = mid;
+  }
+  *found = false;
+  return lo;
+}
+
+static void link_listing(dir_listing* listing) {
+  listing->prev = NULL;
+  listing->next = all_listings;
+  if (all_listings != NULL) {
+    all_listings->prev = listing;
+  }
+  all_listings = listing;
+}
+
+static void unlink_listing(dir_listing* listing) {
+  if (listing->prev != NULL) {
+    listing->prev->next = listing->next;
+  }
+  else {
+    all_listings = listing->next;
+  }
+  if (listing->next != NULL) {
+    listing->next->prev = listing->prev;
+  }
+}
+
+static void delete_listing(dir_listing* listing) {
+  if (listing == NULL) {
+    return;
+  }
+  for (int i=0; i<listing->count; i++) {
+    free(listing->entries[i].name);
+  }
+  free(listing->entries);
+  free(listing);
+}
+
+static int compare_entries(const void* p1, const void* p2) {
+  return strcmp(((snapshot_entry*)p1)->name, ((snapshot_entry*)p2)->name);
+}
+
+static dir_listing* read_listing(int dir_fd) {
+  int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR* dir = (fd >= 0 ? fdopendir(fd) : NULL);
+  if (dir == NULL) {
+    userlog(LOG_DEBUG, "snapshot: %s", strerror(errno));
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+
+  dir_listing* listing = calloc(1, sizeof(dir_listing));
+  bool ok = listing != NULL;
+
+  struct dirent* entry;
+  while (ok && (entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+    struct stat st;
+    if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+
+    if (!grow_listing(listing)) {
+      ok = false;
+      break;
+    }
+
+    snapshot_entry* e = &listing->entries[listing->count];
+    if ((e->name = strdup(entry->d_name)) == NULL) {
+      ok = false;
+      break;
+    }
+    fill_entry(e, &st);
+    listing->count++;
+  }
+  closedir(dir);
+
+  if (!ok) {
+    userlog(LOG_ERR, "out of memory");
+    delete_listing(listing);
+    return NULL;
+  }
+  if (listing->count > 1) {
+    qsort(listing->entries, listing->count, sizeof(snapshot_entry), &compare_entries);
+  }
+  return listing;
+}
+
+
+static void queue_change(const char* event, const char* path, const char* name) {
+  int path_len = strlen(path), name_len = strlen(name);
+  snapshot_change* change = malloc(sizeof(snapshot_change) + path_len + name_len + 2);
+  if (change == NULL || array_push(changes, change) == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    free(change);
+    return;
+  }
+  change->event = event;
+  memcpy(change->path, path, path_len);
+  change->path[path_len] = '/';
+  memcpy(change->path + path_len + 1, name, name_len + 1);
+}
+
+static void queue_created(const char* path, const char* name) {
+  queue_change("CREATE", path, name);
+  queue_change("CHANGE", path, name);
+}
+
+// both listings are sorted, so a single merge pass finds every difference
+static void diff_listings(dir_listing* old, dir_listing* new, const char* path) {
+  int i = 0, j = 0;
+  while (i < old->count || j < new->count) {
+    int c = (i == old->count ? 1 : j == new->count ? -1 : strcmp(old->entries[i].name, new->entries[j].name));
+    if (c < 0) {
+      queue_change("DELETE", path, old->entries[i++].name);
+      continue;
+    }
+    if (c > 0) {
+      queue_created(path, new->entries[j++].name);
+      continue;
+    }
+
+    snapshot_entry* e1 = &old->entries[i++];
+    snapshot_entry* e2 = &new->entries[j++];
+    if (e1->ino != e2->ino || e1->type != e2->type) {
+      queue_change("DELETE", path, e2->name);
+      queue_created(path, e2->name);
+    }
+    else if (e2->type != S_IFDIR && (e1->mtime != e2->mtime || e1->size != e2->size)) {
+      queue_change("CHANGE", path, e2->name);
+    }
+  }
+}
+
+// a saved listing is turned into a transient one, with names pointing into the mapping
+static void diff_saved(dir_listing* listing, const char* path) {
+  const saved_dir* dir = find_saved(path);
+  if (dir == NULL) {
+    return;
+  }
+  uint32_t entry_count = ((const saved_header*)saved_map)->entry_count;
+  if (dir->first > entry_count || dir->count > entry_count - dir->first) {
+    return;
+  }
+
+  dir_listing saved = {.count = dir->count, .capacity = dir->count};
+  saved.entries = malloc((dir->count > 0 ? dir->count : 1) * sizeof(snapshot_entry));
+  if (saved.entries == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    return;
+  }
+  for (uint32_t i=0; i<dir->count; i++) {
+    const saved_entry* e = &saved_entries[dir->first + i];
+    if (e->name >= saved_strings_len) {
+      free(saved.entries);
+      return;
+    }
+    saved.entries[i] = (snapshot_entry){(char*)saved_strings + e->name, e->ino, e->mtime, e->size, e->type};
+  }
+
+  diff_listings(&saved, listing, path);
+  free(saved.entries);
+}
+
+// takes a listing of a directory just walked; called from walker threads
+void snapshot_dir(int wd, int dir_fd, const char* path) {
+  if (listings == NULL) {
+    return;
+  }
+
+  dir_listing* listing = read_listing(dir_fd);
+  if (listing == NULL) {
+    return;
+  }
+
+  listing->wd = wd;
+  pthread_mutex_lock(&snapshot_lock);
+  dir_listing* old = table_get(listings, wd);
+  if (old == NULL) {
+    diff_saved(listing, path);
+  }
+  else {
+    diff_listings(old, listing, path);
+    table_put(listings, wd, NULL);
+    unlink_listing(old);
+    delete_listing(old);
+  }
+  if (table_put(listings, wd, listing) != NULL) {
+    link_listing(listing);
+  }
+  else {
+    userlog(LOG_ERR, "out of memory");
+    delete_listing(listing);
+  }
+  pthread_mutex_unlock(&snapshot_lock);
+}
+
+// an event on an entry of a watched directory; the listing follows what the client has been told,
+// so an entry reported as created stays listed even when it is gone by now (its removal is reported later)
+void snapshot_update(int wd, const char* path, const char* name, bool created, bool removed) {
+  if (listings == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&snapshot_lock);
+  dir_listing* listing = table_get(listings, wd);
+  if (listing != NULL) {
+    bool found;
+    int i = find_entry(listing, name, &found);
+    snapshot_entry* entry = &listing->entries[i];
+
+    struct stat st;
+    bool exists = !removed && lstat(path, &st) == 0;
+    if (!exists) {
+      memset(&st, 0, sizeof(st));
+    }
+
+    if (removed) {
+      if (found) {
+        free(entry->name);
+        memmove(entry, entry + 1, (listing->count - i - 1) * sizeof(snapshot_entry));
+        listing->count--;
+      }
+    }
+    else if (found) {
+      if (exists) {
+        fill_entry(entry, &st);
+      }
+    }
+    else if (created) {
+      char* copy = strdup(name);
+      if (copy == NULL || !grow_listing(listing)) {
+        userlog(LOG_ERR, "out of memory");
+        free(copy);
+      }
+      else {
+        entry = &listing->entries[i];
+        memmove(entry + 1, entry, (listing->count - i) * sizeof(snapshot_entry));
+        entry->name = copy;
+        fill_entry(entry, &st);
+        listing->count++;
+      }
+    }
+  }
+  pthread_mutex_unlock(&snapshot_lock);
+}
+
+void snapshot_drop(int wd) {
+  if (listings == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&snapshot_lock);
+  dir_listing* listing = table_get(listings, wd);
+  if (listing != NULL) {
+    table_put(listings, wd, NULL);
+    unlink_listing(listing);
+    delete_listing(listing);
+  }
+  pthread_mutex_unlock(&snapshot_lock);
+}
+
+// hands queued differences over to the client, in the order they were found
+void snapshot_report(void (* report)(const char* event, const char* path)) {
+  if (array_size(changes) == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&snapshot_lock);
+  for (int i=0; i<array_size(changes); i++) {
+    snapshot_change* change = array_get(changes, i);
+    (*report)(change->event, change->path);
+    free(change);
+  }
+  while (array_size(changes) > 0) {
+    array_pop(changes);
+  }
+  pthread_mutex_unlock(&snapshot_lock);
+}
+
+
+typedef struct {
+  char* path;
+  dir_listing* listing;
+} saved_ref;
+
+static int compare_refs(const void* p1, const void* p2) {
+  return strcmp((*(saved_ref**)p1)->path, (*(saved_ref**)p2)->path);
+}
+
+static bool write_saved(FILE* f, array* refs) {
+  saved_header header = {.version = SNAPSHOT_VERSION, .dir_count = array_size(refs)};
+  memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+  for (int i=0; i<array_size(refs); i++) {
+    header.entry_count += ((saved_ref*)array_get(refs, i))->listing->count;
+  }
+  if (fwrite(&header, sizeof(header), 1, f) != 1) return false;
+
+  // strings go in the same order as the records referring to them: each path followed by names of its entries
+  uint64_t offset = 0;
+  for (int i=0; i<array_size(refs); i++) {
+    saved_ref* ref = array_get(refs, i);
+    offset += strlen(ref->path) + 1;
+    for (int j=0; j<ref->listing->count; j++) {
+      snapshot_entry* e = &ref->listing->entries[j];
+      saved_entry out = {e->ino, e->mtime, e->size, (uint32_t)offset, e->type};
+      if (fwrite(&out, sizeof(out), 1, f) != 1) return false;
+      offset += strlen(e->name) + 1;
+    }
+  }
+  if (offset >= UINT32_MAX) {
+    userlog(LOG_WARNING, "snapshot too large");
+    return false;
+  }
+
+  offset = 0;
+  uint32_t first = 0;
+  for (int i=0; i<array_size(refs); i++) {
+    saved_ref* ref = array_get(refs, i);
+    saved_dir out = {(uint32_t)offset, first, ref->listing->count};
+    if (fwrite(&out, sizeof(out), 1, f) != 1) return false;
+    offset += strlen(ref->path) + 1;
+    for (int j=0; j<ref->listing->count; j++) {
+      offset += strlen(ref->listing->entries[j].name) + 1;
+    }
+    first += ref->listing->count;
+  }
+
+  for (int i=0; i<array_size(refs); i++) {
+    saved_ref* ref = array_get(refs, i);
+    if (fwrite(ref->path, strlen(ref->path) + 1, 1, f) != 1) return false;
+    for (int j=0; j<ref->listing->count; j++) {
+      const char* name = ref->listing->entries[j].name;
+      if (fwrite(name, strlen(name) + 1, 1, f) != 1) return false;
+    }
+  }
+  return true;
+}
+
+// writes listings of all watched directories to the file given at start (through a temporary file and a rename)
+void snapshot_save() {
+  if (saved_file == NULL || listings == NULL) {
+    return;
+  }
+
+  array* refs = array_create(table_size(listings) > 0 ? table_size(listings) : 1);
+  if (refs == NULL) {
+    userlog(LOG_ERR, "out of memory");
+    return;
+  }
+  char path[PATH_MAX];
+  for (dir_listing* listing = all_listings; listing != NULL; listing = listing->next) {
+    if (get_watch_path(listing->wd, path, PATH_MAX) < 0) continue;
+    saved_ref* ref = malloc(sizeof(saved_ref));
+    if (ref == NULL || (ref->path = strdup(path)) == NULL || array_push(refs, ref) == NULL) {
+      userlog(LOG_ERR, "out of memory");
+      if (ref != NULL) free(ref->path);
+      free(ref);
+      break;
+    }
+    ref->listing = listing;
+  }
+  array_sort(refs, &compare_refs);
+
+  int file_len = strlen(saved_file);
+  char tmp[file_len + 5];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", saved_file);
+  FILE* f = fopen(tmp, "we");
+  bool ok = f != NULL && write_saved(f, refs);
+  if (f != NULL && fclose(f) != 0) {
+    ok = false;
+  }
+  if (ok && rename(tmp, saved_file) == 0) {
+    userlog(LOG_INFO, "snapshot %s: %d directories saved", saved_file, array_size(refs));
+  }
+  else {
+    userlog(LOG_WARNING, "snapshot %s: %s", saved_file, strerror(errno));
+    unlink(tmp);
+  }
+
+  for (int i=0; i<array_size(refs); i++) {
+    saved_ref* ref = array_get(refs, i);
+    free(ref->path);
+    free(ref);
+  }
+  array_delete(refs);
+}
+
+void close_snapshots() {
+  snapshot_release_saved();
+  free(saved_file);
+  saved_file = NULL;
+  while (all_listings != NULL) {
+    dir_listing* listing = all_listings;
+    unlink_listing(listing);
+    delete_listing(listing);
+  }
+  table_delete(listings);
+  listings = NULL;
+  array_delete_vs_data(changes);
+  changes = NULL;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright 2000-2016 JetBrains s.r.o.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "fsnotifier.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+
+// Per-stage latency histograms with HDR-style buckets: values below 64 ns are counted exactly, above that
+// each power of two is split into 32 sub-buckets, so any recorded value is off by less than 1/32.
+// All stages run on the main thread, no locking is needed.
+#define SUB_BUCKET_BITS 5
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define BUCKET_COUNT ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+typedef struct {
+  uint64_t counts[BUCKET_COUNT];
+  uint64_t total;
+  uint64_t max;
+} histogram;
+
+static const char* stage_names[TRACE_STAGES] = {"read", "event", "callback", "write"};
+
+static histogram* histograms = NULL;
+
+bool trace_enabled = false;
+
+
+bool init_tracing() {
+  const char* env = getenv(TRACE_ENV);
+  if (env == NULL || env[0] == '\0' || strcmp(env, "0") == 0) {
+    return false;
+  }
+
+  histograms = calloc(TRACE_STAGES, sizeof(histogram));
+  CHECK_NULL(histograms, false);
+  trace_enabled = true;
+  userlog(LOG_INFO, "latency tracing enabled");
+  return true;
+}
+
+uint64_t trace_clock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t value) {
+  if (value < 2 * SUB_BUCKETS) {
+    return (int)value;
+  }
+  int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+  return shift * SUB_BUCKETS + (int)(value >> shift);
+}
+
+// the highest value counted in the bucket
+static uint64_t bucket_value(int bucket) {
+  if (bucket < 2 * SUB_BUCKETS) {
+    return bucket;
+  }
+  int shift = bucket / SUB_BUCKETS - 1;
+  uint64_t sub = bucket - shift * SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+void trace_record(trace_stage stage, uint64_t start) {
+  uint64_t value = trace_clock() - start;
+  histogram* h = &histograms[stage];
+  h->counts[bucket_of(value)]++;
+  h->total++;
+  if (value > h->max) {
+    h->max = value;
+  }
+}
+
+const char* trace_stage_name(trace_stage stage) {
+  return stage_names[stage];
+}
+
+// `quantiles` are fractions in ascending order; the results are in nanoseconds
+uint64_t trace_summary(trace_stage stage, const double* quantiles, uint64_t* values, int count) {
+  histogram* h = (histograms != NULL ? &histograms[stage] : NULL);
+  if (h == NULL || h->total == 0) {
+    memset(values, 0, sizeof(uint64_t) * count);
+    return 0;
+  }
+
+  uint64_t seen = 0;
+  int bucket = 0;
+  for (int i=0; i<count; i++) {
+    uint64_t rank = (uint64_t)(quantiles[i] * h->total + 0.5);
+    if (rank < 1) rank = 1;
+    while (bucket < BUCKET_COUNT && seen + h->counts[bucket] < rank) {
+      seen += h->counts[bucket++];
+    }
+    values[i] = (bucket < BUCKET_COUNT && bucket_value(bucket) < h->max ? bucket_value(bucket) : h->max);
+  }
+  return h->total;
+}
+
+void close_tracing() {
+  free(histograms);
+  histograms = NULL;
+  trace_enabled = false;
+}
@@ -16,6 +16,7 @@
 
 #include "fsnotifier.h"
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -124,52 +125,173 @@ void array_delete_data(array* a) {
   }
 }
 
+void array_sort(array* a, int (* compare)(const void*, const void*)) {
+  if (a != NULL && a->size > 1) {
+    qsort(a->data, a->size, sizeof(void*), compare);
+  }
+}
+
+// `compare` receives pointers to the key and to an array slot, as with bsearch(3)
+void* array_bsearch(array* a, const void* key, int (* compare)(const void*, const void*)) {
+  if (a == NULL || a->size == 0) {
+    return NULL;
+  }
+  void** slot = bsearch(key, a->data, a->size, sizeof(void*), compare);
+  return (slot != NULL ? *slot : NULL);
+}
+
+
+// open addressing with linear probing; deletion shifts the rest of a probe run back,
+// so there are no tombstones and lookups never scan past the first empty slot
+#define TABLE_MIN_CAPACITY 64
+#define TABLE_MAX_LOAD(cap) ((cap) / 2)
+#define TABLE_MIN_LOAD(cap) ((cap) / 8)
+
+typedef struct {
+  int key;
+  void* value;  // NULL marks an empty slot
+} table_entry;
 
 struct __table {
-  void** data;
-  int capacity;
+  table_entry* data;
+  int capacity;  // always a power of two
+  int size;
+  int min_capacity;
 };
 
+static inline int home_slot(table* t, int key) {
+  return (int)(((unsigned int)key * 2654435769u) & (unsigned int)(t->capacity - 1));
+}
+
+static bool table_resize(table* t, int new_capacity) {
+  table_entry* new_data = calloc(new_capacity, sizeof(table_entry));
+  if (new_data == NULL) {
+    return false;
+  }
+
+  table_entry* old_data = t->data;
+  int old_capacity = t->capacity;
+  t->data = new_data;
+  t->capacity = new_capacity;
+
+  for (int i=0; i<old_capacity; i++) {
+    if (old_data[i].value != NULL) {
+      int k = home_slot(t, old_data[i].key);
+      while (t->data[k].value != NULL) {
+        k = (k + 1) & (t->capacity - 1);
+      }
+      t->data[k] = old_data[i];
+    }
+  }
+
+  free(old_data);
+  return true;
+}
+
+static int table_find(table* t, int key) {
+  int k = home_slot(t, key);
+  while (t->data[k].value != NULL) {
+    if (t->data[k].key == key) {
+      return k;
+    }
+    k = (k + 1) & (t->capacity - 1);
+  }
+  return -1;
+}
+
+// `capacity` is the initial number of slots (rounded up to a power of two); the table grows and shrinks
+// with its contents, but never below that
 table* table_create(int capacity) {
   table* t = calloc(1, sizeof(table));
   if (t == NULL) {
     return NULL;
   }
 
-  t->data = calloc(capacity, sizeof(void*));
+  int cap = TABLE_MIN_CAPACITY;
+  while (cap < capacity) {
+    cap *= 2;
+  }
+
+  t->data = calloc(cap, sizeof(table_entry));
   if (t->data == NULL) {
     free(t);
     return NULL;
   }
 
-  t->capacity = capacity;
+  t->capacity = cap;
+  t->min_capacity = cap;
+  t->size = 0;
 
   return t;
 }
 
-static inline int wrap(int key, table* t) {
-  return (t != NULL ? key % t->capacity : -1);
+static void table_remove(table* t, int key) {
+  int i = table_find(t, key);
+  if (i < 0) {
+    return;
+  }
+
+  int mask = t->capacity - 1;
+  for (int j = (i + 1) & mask; t->data[j].value != NULL; j = (j + 1) & mask) {
+    int k = home_slot(t, t->data[j].key);
+    bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+    if (!stays) {
+      t->data[i] = t->data[j];
+      i = j;
+    }
+  }
+  t->data[i].value = NULL;
+  t->size--;
+
+  if (t->capacity > t->min_capacity && t->size < TABLE_MIN_LOAD(t->capacity)) {
+    table_resize(t, t->capacity / 2);
+  }
 }
 
-// todo: resolve collisions (?)
+// putting NULL removes the key; returns NULL when the key is already mapped or memory is exhausted
 void* table_put(table* t, int key, void* value) {
-  int k = wrap(key, t);
-  if (k < 0 || (value != NULL && t->data[k] != NULL)) {
+  if (t == NULL) {
     return NULL;
   }
-  else {
-    return t->data[k] = value;
+
+  if (value == NULL) {
+    table_remove(t, key);
+    return NULL;
+  }
+
+  if (table_find(t, key) >= 0) {
+    return NULL;
+  }
+
+  if (t->size + 1 > TABLE_MAX_LOAD(t->capacity) && !table_resize(t, t->capacity * 2)) {
+    return NULL;
   }
+
+  int k = home_slot(t, key);
+  while (t->data[k].value != NULL) {
+    k = (k + 1) & (t->capacity - 1);
+  }
+  t->data[k].key = key;
+  t->data[k].value = value;
+  t->size++;
+
+  return value;
 }
 
 void* table_get(table* t, int key) {
-  int k = wrap(key, t);
-  if (k < 0) {
+  if (t == NULL) {
     return NULL;
   }
-  else {
-    return t->data[k];
-  }
+  int k = table_find(t, key);
+  return (k >= 0 ? t->data[k].value : NULL);
+}
+
+int table_size(table* t) {
+  return (t != NULL ? t->size : 0);
+}
+
+size_t table_memory(table* t) {
+  return (t != NULL ? sizeof(table) + sizeof(table_entry) * t->capacity : 0);
 }
 
 void table_delete(table* t) {
@@ -180,6 +302,182 @@ void table_delete(table* t) {
 }
 
 
+// Interned strings are reference-counted and identified by a 32-bit id; identical strings share one copy.
+// The index is an open-addressing set of ids hashed by content, with back-shift deletion as in the table above.
+#define INTERN_MIN_CAPACITY 256
+
+typedef struct {
+  char* str;
+  uint32_t len;
+  uint32_t refs;  // zero means the entry is free
+  uint32_t hash;  // next free entry, for free ones
+} interned;
+
+static interned* strings = NULL;
+static uint32_t strings_used = 0;
+static uint32_t strings_capacity = 0;
+static uint32_t free_strings = NO_STRING;
+static uint32_t live_strings = 0;
+static size_t string_bytes = 0;
+
+static uint32_t* string_index = NULL;
+static uint32_t index_capacity = 0;
+
+static uint32_t hash_string(const char* s, int len) {
+  uint32_t h = 2166136261u;
+  for (int i=0; i<len; i++) {
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  }
+  return h;
+}
+
+static bool index_resize(uint32_t new_capacity) {
+  uint32_t* new_index = malloc(sizeof(uint32_t) * new_capacity);
+  if (new_index == NULL) {
+    return false;
+  }
+  memset(new_index, 0xFF, sizeof(uint32_t) * new_capacity);
+
+  for (uint32_t i=0; i<index_capacity; i++) {
+    uint32_t id = string_index[i];
+    if (id != NO_STRING) {
+      uint32_t k = strings[id].hash & (new_capacity - 1);
+      while (new_index[k] != NO_STRING) {
+        k = (k + 1) & (new_capacity - 1);
+      }
+      new_index[k] = id;
+    }
+  }
+
+  free(string_index);
+  string_index = new_index;
+  index_capacity = new_capacity;
+  return true;
+}
+
+static uint32_t index_find(const char* s, int len, uint32_t hash) {
+  if (index_capacity == 0) {
+    return NO_STRING;
+  }
+  uint32_t k = hash & (index_capacity - 1);
+  while (string_index[k] != NO_STRING) {
+    interned* e = &strings[string_index[k]];
+    if (e->hash == hash && e->len == (uint32_t)len && memcmp(e->str, s, len) == 0) {
+      return k;
+    }
+    k = (k + 1) & (index_capacity - 1);
+  }
+  return NO_STRING;
+}
+
+uint32_t intern_find(const char* s, int len) {
+  uint32_t k = index_find(s, len, hash_string(s, len));
+  return (k != NO_STRING ? string_index[k] : NO_STRING);
+}
+
+uint32_t intern_string(const char* s, int len) {
+  uint32_t hash = hash_string(s, len);
+  uint32_t k = index_find(s, len, hash);
+  if (k != NO_STRING) {
+    strings[string_index[k]].refs++;
+    return string_index[k];
+  }
+
+  if ((live_strings + 1) * 2 > index_capacity &&
+      !index_resize(index_capacity > 0 ? index_capacity * 2 : INTERN_MIN_CAPACITY)) {
+    return NO_STRING;
+  }
+
+  char* copy = malloc(len + 1);
+  if (copy == NULL) {
+    return NO_STRING;
+  }
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+
+  uint32_t id = free_strings;
+  if (id != NO_STRING) {
+    free_strings = strings[id].hash;
+  }
+  else {
+    if (strings_used == strings_capacity) {
+      uint32_t new_cap = (strings_capacity > 0 ? strings_capacity * 2 : INTERN_MIN_CAPACITY);
+      interned* new_strings = realloc(strings, sizeof(interned) * new_cap);
+      if (new_strings == NULL) {
+        free(copy);
+        return NO_STRING;
+      }
+      strings = new_strings;
+      strings_capacity = new_cap;
+    }
+    id = strings_used++;
+  }
+
+  strings[id] = (interned){copy, (uint32_t)len, 1, hash};
+  live_strings++;
+  string_bytes += len + 1;
+
+  k = hash & (index_capacity - 1);
+  while (string_index[k] != NO_STRING) {
+    k = (k + 1) & (index_capacity - 1);
+  }
+  string_index[k] = id;
+
+  return id;
+}
+
+void intern_release(uint32_t id) {
+  if (id == NO_STRING || --strings[id].refs > 0) {
+    return;
+  }
+
+  interned* e = &strings[id];
+  uint32_t i = index_find(e->str, e->len, e->hash);
+  uint32_t mask = index_capacity - 1;
+  for (uint32_t j = (i + 1) & mask; string_index[j] != NO_STRING; j = (j + 1) & mask) {
+    uint32_t k = strings[string_index[j]].hash & mask;
+    bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+    if (!stays) {
+      string_index[i] = string_index[j];
+      i = j;
+    }
+  }
+  string_index[i] = NO_STRING;
+
+  free(e->str);
+  e->str = NULL;
+  e->hash = free_strings;
+  free_strings = id;
+  live_strings--;
+  string_bytes -= e->len + 1;
+}
+
+const char* intern_get(uint32_t id) {
+  return strings[id].str;
+}
+
+int intern_length(uint32_t id) {
+  return strings[id].len;
+}
+
+size_t intern_memory() {
+  return string_bytes + sizeof(interned) * strings_capacity + sizeof(uint32_t) * index_capacity;
+}
+
+void intern_cleanup() {
+  for (uint32_t i=0; i<strings_used; i++) {
+    free(strings[i].str);
+  }
+  free(strings);
+  free(string_index);
+  strings = NULL;
+  string_index = NULL;
+  strings_used = strings_capacity = index_capacity = live_strings = 0;
+  string_bytes = 0;
+  free_strings = NO_STRING;
+}
+
+
 #define INPUT_BUF_LEN 2048
 static char input_buf[INPUT_BUF_LEN];
 